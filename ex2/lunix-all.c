@@ -0,0 +1,364 @@
+/*
+ * lunix-all.c
+ *
+ * The Lunix:TNG aggregate device [/dev/lunix-all]: a single
+ * misc device streaming the updates of all sensors as
+ * struct lunix_record, so that a collector does not have
+ * to open and poll a node per measurement.
+ *
+ * Every open file gets a ring of lunix_all_ring records.
+ * lunix_sensor_update() is the producer, appending records
+ * for the measurements the file has subscribed to; read()
+ * is the consumer. Producers serialize on lunix_all_lock,
+ * read() on the per-file mutex, and the two sides only meet
+ * at the head and tail indices. When a ring is full, new
+ * records are dropped and counted as lost.
+ *
+ * The ring, preceded by a header page holding the indices,
+ * can also be mapped to userspace, in which case the reader
+ * consumes records in place and advances tail itself, and
+ * only needs poll() to sleep [see lunix-ring.h].
+ *
+ */
+
+#include <linux/fs.h>
+#include <linux/list.h>
+#include <linux/poll.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/vmalloc.h>
+#include <linux/bitmap.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/uaccess.h>
+#include <linux/spinlock.h>
+#include <linux/miscdevice.h>
+
+#include "lunix.h"
+#include "lunix-all.h"
+
+int lunix_all_ring = LUNIX_ALL_RING;
+int lunix_all_max = LUNIX_ALL_MAX;
+static atomic_t lunix_all_available;
+
+/*
+ * All open files, protected by lunix_all_lock,
+ * and the readers waiting on any of them
+ */
+static LIST_HEAD(lunix_all_list);
+static DEFINE_SPINLOCK(lunix_all_lock);
+static DECLARE_WAIT_QUEUE_HEAD(lunix_all_wq);
+
+/*
+ * Private state for an open aggregate device
+ */
+struct lunix_all_state_struct {
+	struct list_head list;
+
+	/*
+	 * The record ring, in a single vmalloc_user() area right
+	 * after its header page. head is only advanced by producers,
+	 * under lunix_all_lock, and tail only by the reader, under
+	 * lock or through the mapping; both run freely and are
+	 * masked with size - 1. Since userspace may scribble over
+	 * tail, nothing may trust head - tail to be at most size.
+	 */
+	struct lunix_all_ring_header *hdr;
+	struct lunix_record *ring;
+	unsigned long size;
+
+	/*
+	 * Subscriptions, one bit per measurement of every
+	 * node id, heard from or not: bit (node - 1) * N_LUNIX_MSR + type
+	 */
+	unsigned long *subs;
+
+	struct mutex lock;
+};
+
+static inline uint64_t lunix_all_avail(struct lunix_all_state_struct *state)
+{
+	return smp_load_acquire(&state->hdr->head) - READ_ONCE(state->hdr->tail);
+}
+
+/*
+ * Append records for the new samples of a sensor
+ * [one per measurement, as passed to lunix_sensor_hist_push()]
+ * to the ring of every open file subscribed to them.
+ * Waking up the readers is left to lunix_all_wake().
+ * Called with the sensor spinlock held, so that the records
+ * of a sensor go out in seq order.
+ */
+void lunix_all_publish(struct lunix_sensor_struct *s,
+	const struct lunix_msr_sample_struct *smp)
+{
+	struct lunix_all_state_struct *state;
+	struct lunix_record *rec;
+	uint64_t head;
+	int node, type;
+
+	if (list_empty(&lunix_all_list))
+		return;
+
+	node = s->id;
+
+	spin_lock(&lunix_all_lock);
+	list_for_each_entry(state, &lunix_all_list, list)
+		for (type = 0; type < N_LUNIX_MSR; type++) {
+			if (!test_bit(node * N_LUNIX_MSR + type, state->subs))
+				continue;
+
+			head = state->hdr->head;
+			if (head - smp_load_acquire(&state->hdr->tail) >= state->size) {
+				state->hdr->lost++;
+				continue;
+			}
+
+			rec = &state->ring[head & (state->size - 1)];
+			lunix_record_fill(rec, s, type, &smp[type]);
+
+			/* Publish the record before the new head */
+			smp_store_release(&state->hdr->head, head + 1);
+		}
+	spin_unlock(&lunix_all_lock);
+}
+
+/*
+ * wq_has_sleeper() orders the check after the head updates
+ * published by lunix_all_publish(), pairing with the barrier in
+ * prepare_to_wait() [or lunix_all_poll()] on the reader's side, so a
+ * reader cannot miss a record and go to sleep on it.
+ */
+void lunix_all_wake(void)
+{
+	if (wq_has_sleeper(&lunix_all_wq))
+		wake_up_interruptible(&lunix_all_wq);
+}
+
+/*
+ * Implementation of file operations
+ * for the aggregate device
+ */
+
+static int lunix_all_open(struct inode *inode, struct file *filp)
+{
+	struct lunix_all_state_struct *state;
+	int nbits = lunix_sensor_cnt * N_LUNIX_MSR;
+	int ret;
+
+	if ((ret = nonseekable_open(inode, filp)) < 0)
+		return ret;
+
+	/* Can only be opened a limited number of times at once */
+	if (!atomic_add_unless(&lunix_all_available, -1, 0))
+		return -EBUSY;
+
+	ret = -ENOMEM;
+	state = kzalloc(sizeof(*state), GFP_KERNEL);
+	if (!state)
+		goto out;
+	state->size = lunix_all_ring;
+	state->hdr = vmalloc_user(PAGE_SIZE + state->size * sizeof(*state->ring));
+	if (!state->hdr)
+		goto out_with_state;
+	state->hdr->size = state->size;
+	state->ring = (struct lunix_record *)((char *)state->hdr + PAGE_SIZE);
+	state->subs = kvcalloc(BITS_TO_LONGS(nbits), sizeof(unsigned long), GFP_KERNEL);
+	if (!state->subs)
+		goto out_with_ring;
+	bitmap_fill(state->subs, nbits);
+	mutex_init(&state->lock);
+	filp->private_data = state;
+
+	spin_lock(&lunix_all_lock);
+	list_add_tail(&state->list, &lunix_all_list);
+	spin_unlock(&lunix_all_lock);
+
+	return 0;
+
+out_with_ring:
+	vfree(state->hdr);
+out_with_state:
+	kfree(state);
+out:
+	atomic_inc(&lunix_all_available);
+	return ret;
+}
+
+static int lunix_all_release(struct inode *inode, struct file *filp)
+{
+	struct lunix_all_state_struct *state = filp->private_data;
+
+	spin_lock(&lunix_all_lock);
+	list_del(&state->list);
+	spin_unlock(&lunix_all_lock);
+
+	if (state->hdr->lost)
+		debug("%llu records lost\n", state->hdr->lost);
+	kvfree(state->subs);
+	vfree(state->hdr);
+	kfree(state);
+
+	atomic_inc(&lunix_all_available);
+	return 0;
+}
+
+static int lunix_all_subscribe(struct lunix_all_state_struct *state,
+	struct lunix_all_subscription *sub)
+{
+	int i, type, bit;
+
+	if (sub->first < 1 || sub->types & ~((1U << N_LUNIX_MSR) - 1))
+		return -EINVAL;
+
+	spin_lock(&lunix_all_lock);
+	for (i = 0; i < 64 && sub->first + i <= lunix_sensor_cnt; i++)
+		for (type = 0; type < N_LUNIX_MSR; type++) {
+			bit = (sub->first + i - 1) * N_LUNIX_MSR + type;
+			if ((sub->nodes & (1ULL << i)) && (sub->types & (1U << type)))
+				__set_bit(bit, state->subs);
+			else
+				__clear_bit(bit, state->subs);
+		}
+	spin_unlock(&lunix_all_lock);
+
+	return 0;
+}
+
+static long lunix_all_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct lunix_all_state_struct *state = filp->private_data;
+	struct lunix_all_subscription sub;
+
+	switch (cmd) {
+	case LUNIX_ALL_IOC_SUBSCRIBE:
+		if (copy_from_user(&sub, (void __user *)arg, sizeof(sub)))
+			return -EFAULT;
+		return lunix_all_subscribe(state, &sub);
+	default:
+		return -ENOTTY;
+	}
+}
+
+/*
+ * Copy as many whole records as fit in the user buffer,
+ * sleeping until there is at least one.
+ */
+static ssize_t lunix_all_read(struct file *filp, char __user *usrbuf, size_t cnt, loff_t *f_pos)
+{
+	struct lunix_all_state_struct *state = filp->private_data;
+	uint64_t tail, n, first;
+	ssize_t ret;
+
+	if (cnt < sizeof(struct lunix_record))
+		return -EINVAL;
+
+	if (mutex_lock_interruptible(&state->lock))
+		return -ERESTARTSYS;
+
+	while (!lunix_all_avail(state)) {
+		mutex_unlock(&state->lock);
+
+		if (filp->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if (wait_event_interruptible(lunix_all_wq, lunix_all_avail(state)))
+			return -ERESTARTSYS;
+
+		if (mutex_lock_interruptible(&state->lock))
+			return -ERESTARTSYS;
+	}
+
+	tail = READ_ONCE(state->hdr->tail);
+	n = min_t(uint64_t, smp_load_acquire(&state->hdr->head) - tail,
+		min_t(uint64_t, state->size, cnt / sizeof(struct lunix_record)));
+
+	/* The records may wrap around the end of the ring */
+	first = min_t(uint64_t, n, state->size - (tail & (state->size - 1)));
+	ret = -EFAULT;
+	if (copy_to_user(usrbuf, &state->ring[tail & (state->size - 1)],
+			first * sizeof(struct lunix_record)))
+		goto out;
+	if (copy_to_user(usrbuf + first * sizeof(struct lunix_record), state->ring,
+			(n - first) * sizeof(struct lunix_record)))
+		goto out;
+
+	/* Done with the records, hand their slots back to the producers */
+	smp_store_release(&state->hdr->tail, tail + n);
+	ret = n * sizeof(struct lunix_record);
+
+out:
+	mutex_unlock(&state->lock);
+	return ret;
+}
+
+/*
+ * Map the header page and the ring to userspace. The mapping
+ * must be shared and start at the header; it may stop short of
+ * the end of the ring, e.g. to read the size from the header.
+ */
+static int lunix_all_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct lunix_all_state_struct *state = filp->private_data;
+
+	if (vma->vm_pgoff ||
+	    vma->vm_end - vma->vm_start > PAGE_SIZE + state->size * sizeof(struct lunix_record))
+		return -EINVAL;
+	if (!(vma->vm_flags & VM_SHARED))
+		return -EINVAL;
+
+	return remap_vmalloc_range(vma, state->hdr, 0);
+}
+
+static unsigned int lunix_all_poll(struct file *filp, poll_table *wait)
+{
+	struct lunix_all_state_struct *state = filp->private_data;
+
+	poll_wait(filp, &lunix_all_wq, wait);
+	/* Pairs with wq_has_sleeper() in lunix_all_wake() */
+	smp_mb();
+
+	return lunix_all_avail(state) ? POLLIN | POLLRDNORM : 0;
+}
+
+static struct file_operations lunix_all_fops =
+{
+	.owner          = THIS_MODULE,
+	.open           = lunix_all_open,
+	.release        = lunix_all_release,
+	.read           = lunix_all_read,
+	.unlocked_ioctl = lunix_all_ioctl,
+	.poll           = lunix_all_poll,
+	.mmap           = lunix_all_mmap,
+	.llseek         = no_llseek
+};
+
+static struct miscdevice lunix_all_miscdev =
+{
+	.minor          = MISC_DYNAMIC_MINOR,
+	.name           = "lunix-all",
+	.fops           = &lunix_all_fops,
+	.mode           = 0660	/* Not world-readable; writable, for mapping the ring to advance tail */
+};
+
+int lunix_all_init(void)
+{
+	int ret;
+
+	BUILD_BUG_ON(sizeof(struct lunix_all_ring_header) > PAGE_SIZE);
+	BUILD_BUG_ON(offsetof(struct lunix_all_ring_header, tail) % 64);
+
+	atomic_set(&lunix_all_available, lunix_all_max);
+
+	debug("registering aggregate device\n");
+	ret = misc_register(&lunix_all_miscdev);
+	if (ret < 0)
+		printk(KERN_ERR "%s: Error registering aggregate device, ret = %d.\n", __FILE__, ret);
+
+	return ret;
+}
+
+void lunix_all_destroy(void)
+{
+	debug("unregistering aggregate device\n");
+	misc_deregister(&lunix_all_miscdev);
+}
@@ -0,0 +1,84 @@
+/*
+ * lunix-all.h
+ *
+ * Definition file for the Lunix:TNG aggregate device
+ * [/dev/lunix-all], which streams the updates of every
+ * measurement of every sensor as fixed-size binary records.
+ *
+ */
+
+#ifndef _LUNIX_ALL_H
+#define _LUNIX_ALL_H
+
+#include "lunix.h"
+
+/*
+ * The default number of records buffered per open file
+ * [rounded up to a power of two], and the most allowed
+ */
+#define LUNIX_ALL_RING		1024
+#define LUNIX_ALL_RING_MAX	65536
+
+/*
+ * The default maximum number of open files at any time: each
+ * one costs a ring and a subscription bitmap of kernel memory
+ */
+#define LUNIX_ALL_MAX		16
+
+/*
+ * The first page of the ring of an open file, when mapped to
+ * userspace [see lunix-ring.h]. The records follow it, in the
+ * next size * sizeof(struct lunix_record) bytes of the mapping.
+ *
+ * head is only advanced by the driver, tail only by the reader.
+ * Both run freely, the record at position pos lives in slot
+ * pos & (size - 1), and head - tail records are unread. A reader
+ * must load head with acquire semantics before looking at the
+ * records, and store tail with release semantics when done with
+ * them; until then the driver does not reuse their slots but drops
+ * new records instead, counting them in lost.
+ */
+struct lunix_all_ring_header {
+	uint64_t head;
+	uint64_t lost;
+	uint32_t size;		/* Records in the ring, a power of two */
+	uint32_t __pad0;
+	uint64_t __pad1[5];
+	uint64_t tail;		/* On a cache line of its own */
+};
+
+#ifdef __KERNEL__
+
+extern int lunix_all_ring;
+extern int lunix_all_max;
+
+/*
+ * Function prototypes
+ */
+int lunix_all_init(void);
+void lunix_all_destroy(void);
+void lunix_all_publish(struct lunix_sensor_struct *s,
+	const struct lunix_msr_sample_struct *smp);
+void lunix_all_wake(void);
+
+#endif	/* __KERNEL__ */
+
+#include <linux/ioctl.h>
+
+/*
+ * Subscribe an open file to the measurements in types [a bitmask
+ * of 1 << BATT, 1 << TEMP and 1 << LIGHT] of the 64 nodes with ids
+ * first .. first + 63 whose bits are set in nodes, and unsubscribe
+ * it from the rest of them. Nodes outside this range are left
+ * alone. A newly opened file is subscribed to everything.
+ */
+struct lunix_all_subscription {
+	uint32_t first;
+	uint32_t types;
+	uint64_t nodes;
+};
+
+#define LUNIX_ALL_IOC_MAGIC		'A'
+#define LUNIX_ALL_IOC_SUBSCRIBE		_IOW(LUNIX_ALL_IOC_MAGIC, 1, struct lunix_all_subscription)
+
+#endif	/* _LUNIX_ALL_H */
@@ -32,6 +32,8 @@
 #include <sys/ioctl.h>
 
 #include "lunix.h"
+#include "lunix-ldisc.h"
+#include "lunix-protocol.h"
 
 #ifndef _PATH_LOCKD
 #define _PATH_LOCKD		"/var/lock"		/* lock files   */
@@ -354,9 +356,27 @@ static int tty_restore(void)
 	return 0;
 }
 
+/* Report what the line discipline has seen so far. */
+static void tty_show_stats(void)
+{
+	struct lunix_protocol_stats stats;
+
+	if (ioctl(tty_fd, LUNIX_LDISC_IOC_STATS, &stats) < 0) {
+		perror("get Lunix:TNG statistics");
+		return;
+	}
+	fprintf(stderr, "%llu bytes, %llu packets, %llu dropped for bad CRC, "
+		"%llu resyncs skipping %llu bytes\n",
+		(unsigned long long)stats.bytes, (unsigned long long)stats.packets,
+		(unsigned long long)stats.crc_errors,
+		(unsigned long long)stats.resyncs, (unsigned long long)stats.resync_bytes);
+}
+
 /* Close down a terminal line. */
 static int tty_close(void)
 {
+	tty_show_stats();
+
 	/*
 	 * Set the old discipline and restore the
 	 * previous line mode.
@@ -0,0 +1,515 @@
+/*
+ * lunix-bench.c
+ *
+ * Userspace benchmarks for the Lunix:TNG character device.
+ *
+ * Every benchmark follows Lunix nodes [/dev/lunix<NO>-<TYPE>]
+ * for a fixed amount of time and reports how many bytes it got
+ * and how much CPU time it, and any children, burnt doing so.
+ *
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <sys/resource.h>
+
+#include "lunix.h"
+#include "lunix-all.h"
+#include "lunix-msr.h"
+#include "lunix-ring.h"
+#include "lunix-chrdev.h"
+
+#define BENCH_MAX_NODES		(16 * 3)	/* 16 sensors, 3 measurements each */
+
+static const char *msr_names[] = { "batt", "temp", "light" };
+
+struct bench_result {
+	unsigned long reads;	/* read() calls that returned data */
+	unsigned long calls;	/* read() calls in total */
+	unsigned long bytes;
+	unsigned long lat_cnt;	/* Latencies measured */
+	double lat_sum;		/* Sum of update-to-read latencies, in s */
+	double lat_max;
+};
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double tv_sec(struct timeval *tv)
+{
+	return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+/* Open every measurement node of the first nsensors sensors. */
+static int open_nodes(int *fds, int nsensors, int flags)
+{
+	int s, m, n;
+	char path[64];
+
+	if (nsensors * 3 > BENCH_MAX_NODES) {
+		fprintf(stderr, "At most %d sensors supported\n", BENCH_MAX_NODES / 3);
+		return -1;
+	}
+
+	n = 0;
+	for (s = 0; s < nsensors; s++)
+		for (m = 0; m < 3; m++) {
+			snprintf(path, sizeof(path), "/dev/lunix%d-%s", s, msr_names[m]);
+			if ((fds[n] = open(path, O_RDONLY | flags)) < 0) {
+				fprintf(stderr, "open(%s): %s\n", path, strerror(errno));
+				return -1;
+			}
+			n++;
+		}
+
+	return n;
+}
+
+/*
+ * Busy-spin on non-blocking reads, like test.c does.
+ */
+static int bench_spin(int nsensors, double secs, struct bench_result *res)
+{
+	int fds[BENCH_MAX_NODES];
+	char buf[4096];
+	double end;
+	ssize_t r;
+	int i, n;
+
+	if ((n = open_nodes(fds, nsensors, O_NONBLOCK)) < 0)
+		return -1;
+
+	end = now_sec() + secs;
+	while (now_sec() < end)
+		for (i = 0; i < n; i++) {
+			r = read(fds[i], buf, sizeof(buf));
+			res->calls++;
+			if (r > 0) {
+				res->reads++;
+				res->bytes += r;
+			}
+		}
+
+	for (i = 0; i < n; i++)
+		close(fds[i]);
+	return 0;
+}
+
+/*
+ * Sleep in a single epoll loop watching all nodes.
+ */
+static int bench_epoll(int nsensors, double secs, struct bench_result *res)
+{
+	int fds[BENCH_MAX_NODES];
+	struct epoll_event ev, evs[BENCH_MAX_NODES];
+	char buf[4096];
+	double end, left;
+	int i, n, nev, epfd;
+	ssize_t r;
+
+	if ((n = open_nodes(fds, nsensors, O_NONBLOCK)) < 0)
+		return -1;
+	if ((epfd = epoll_create1(0)) < 0) {
+		perror("epoll_create1");
+		return -1;
+	}
+	for (i = 0; i < n; i++) {
+		ev.events = EPOLLIN;
+		ev.data.fd = fds[i];
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, fds[i], &ev) < 0) {
+			perror("epoll_ctl");
+			return -1;
+		}
+	}
+
+	end = now_sec() + secs;
+	while ((left = end - now_sec()) > 0) {
+		nev = epoll_wait(epfd, evs, n, (int)(left * 1000) + 1);
+		if (nev < 0 && errno != EINTR) {
+			perror("epoll_wait");
+			return -1;
+		}
+		for (i = 0; i < nev; i++) {
+			r = read(evs[i].data.fd, buf, sizeof(buf));
+			res->calls++;
+			if (r > 0) {
+				res->reads++;
+				res->bytes += r;
+			}
+		}
+	}
+
+	close(epfd);
+	for (i = 0; i < n; i++)
+		close(fds[i]);
+	return 0;
+}
+
+static volatile sig_atomic_t reader_done;
+
+static void reader_alarm(int sig)
+{
+	reader_done = 1;
+}
+
+/*
+ * A single blocking cooked reader of a node, opening path unless
+ * handed an open fd. Latency is measured from the monotonic receive
+ * time of the latest update, as published on the measurement page,
+ * to the return of read().
+ */
+static void reader_child(const char *path, int fd, double secs, int outfd)
+{
+	const struct lunix_msr_data_struct *msr;
+	struct lunix_msr_snapshot snap;
+	struct bench_result res;
+	struct sigaction sa;
+	char buf[4096];
+	double lat;
+	ssize_t r;
+
+	memset(&res, 0, sizeof(res));
+	if ((fd < 0 && (fd = open(path, O_RDONLY)) < 0) || !(msr = lunix_msr_map(fd))) {
+		perror(path);
+		exit(1);
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = reader_alarm;	/* No SA_RESTART, to break out of read() */
+	sigaction(SIGALRM, &sa, NULL);
+	alarm((unsigned int)secs + 1);
+
+	while (!reader_done) {
+		r = read(fd, buf, sizeof(buf));
+		res.calls++;
+		if (r <= 0)
+			continue;
+		lunix_msr_snapshot(msr, &snap);
+		lat = now_sec() - snap.update_ns / 1e9;
+		res.reads++;
+		res.bytes += r;
+		res.lat_cnt++;
+		res.lat_sum += lat;
+		if (lat > res.lat_max)
+			res.lat_max = lat;
+	}
+
+	if (write(outfd, &res, sizeof(res)) != sizeof(res))
+		exit(1);
+	exit(0);
+}
+
+/*
+ * Fork a blocking reader for each of the nodes in paths[],
+ * or sharing fd if it is open, and add up their results.
+ */
+static int fork_readers(const char **paths, int fd, int nreaders, double secs, struct bench_result *res)
+{
+	struct bench_result cres;
+	int pfd[2];
+	int i;
+
+	if (pipe(pfd) < 0) {
+		perror("pipe");
+		return -1;
+	}
+	for (i = 0; i < nreaders; i++)
+		if (fork() == 0) {
+			close(pfd[0]);
+			reader_child(paths[i], fd, secs, pfd[1]);
+		}
+	close(pfd[1]);
+
+	for (i = 0; i < nreaders; i++) {
+		if (read(pfd[0], &cres, sizeof(cres)) != sizeof(cres))
+			break;
+		res->calls += cres.calls;
+		res->reads += cres.reads;
+		res->bytes += cres.bytes;
+		res->lat_cnt += cres.lat_cnt;
+		res->lat_sum += cres.lat_sum;
+		if (cres.lat_max > res->lat_max)
+			res->lat_max = cres.lat_max;
+	}
+	while (wait(NULL) > 0)
+		;
+	close(pfd[0]);
+
+	return (i == nreaders) ? 0 : -1;
+}
+
+/*
+ * Many blocking readers on the same cooked node, to see how read
+ * latency and CPU cost grow with the number of readers.
+ */
+static int bench_readers(int nreaders, double secs, struct bench_result *res)
+{
+	const char **paths;
+	int i, ret;
+
+	if (!(paths = calloc(nreaders, sizeof(*paths)))) {
+		perror("calloc");
+		return -1;
+	}
+	for (i = 0; i < nreaders; i++)
+		paths[i] = "/dev/lunix0-temp";
+
+	ret = fork_readers(paths, -1, nreaders, secs, res);
+	free(paths);
+	return ret;
+}
+
+/*
+ * Like "readers", but all of them share a single open file, like
+ * the "fork" test in test.c, so that they compete for its samples.
+ */
+static int bench_shared(int nreaders, double secs, struct bench_result *res)
+{
+	const char **paths;
+	int i, fd, ret;
+
+	if (!(paths = calloc(nreaders, sizeof(*paths)))) {
+		perror("calloc");
+		return -1;
+	}
+	for (i = 0; i < nreaders; i++)
+		paths[i] = "/dev/lunix0-temp";
+	if ((fd = open(paths[0], O_RDONLY)) < 0) {
+		perror(paths[0]);
+		free(paths);
+		return -1;
+	}
+
+	ret = fork_readers(paths, fd, nreaders, secs, res);
+	close(fd);
+	free(paths);
+	return ret;
+}
+
+/*
+ * A blocking reader per node of the first nsensors sensors,
+ * the way test.c reads them; the baseline for lunix-uring.
+ */
+static int bench_blocking(int nsensors, double secs, struct bench_result *res)
+{
+	static char names[BENCH_MAX_NODES][64];
+	const char *paths[BENCH_MAX_NODES];
+	int s, m, n;
+
+	if (nsensors * 3 > BENCH_MAX_NODES) {
+		fprintf(stderr, "At most %d sensors supported\n", BENCH_MAX_NODES / 3);
+		return -1;
+	}
+
+	n = 0;
+	for (s = 0; s < nsensors; s++)
+		for (m = 0; m < 3; m++) {
+			snprintf(names[n], sizeof(names[n]), "/dev/lunix%d-%s", s, msr_names[m]);
+			paths[n] = names[n];
+			n++;
+		}
+
+	return fork_readers(paths, -1, n, secs, res);
+}
+
+/*
+ * Open the aggregate device, subscribed to every
+ * measurement of the first nsensors sensors.
+ */
+static int open_all(int nsensors, int flags)
+{
+	struct lunix_all_subscription sub;
+	int fd;
+
+	if ((fd = open("/dev/lunix-all", flags)) < 0) {
+		perror("/dev/lunix-all");
+		return -1;
+	}
+	sub.first = 1;
+	sub.types = (1 << BATT) | (1 << TEMP) | (1 << LIGHT);
+	sub.nodes = (nsensors >= 64) ? ~0ULL : (1ULL << nsensors) - 1;
+	if (ioctl(fd, LUNIX_ALL_IOC_SUBSCRIBE, &sub) < 0) {
+		perror("LUNIX_ALL_IOC_SUBSCRIBE");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * A single blocking reader of the aggregate device, subscribed
+ * to every measurement of the first nsensors sensors. Latency is
+ * measured from the timestamp of each record.
+ */
+static int bench_all(int nsensors, double secs, struct bench_result *res)
+{
+	struct lunix_record recs[256];
+	struct sigaction sa;
+	double lat;
+	ssize_t r;
+	int i, fd;
+
+	if ((fd = open_all(nsensors, O_RDONLY)) < 0)
+		return -1;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = reader_alarm;	/* No SA_RESTART, to break out of read() */
+	sigaction(SIGALRM, &sa, NULL);
+	alarm((unsigned int)secs + 1);
+
+	while (!reader_done) {
+		r = read(fd, recs, sizeof(recs));
+		res->calls++;
+		if (r <= 0)
+			continue;
+		res->reads++;
+		res->bytes += r;
+		for (i = 0; i < r / (ssize_t)sizeof(recs[0]); i++) {
+			lat = now_sec() - recs[i].timestamp / 1e9;
+			res->lat_cnt++;
+			res->lat_sum += lat;
+			if (lat > res->lat_max)
+				res->lat_max = lat;
+		}
+	}
+
+	close(fd);
+	return 0;
+}
+
+/*
+ * Like "all", but consuming the records in place through the
+ * mapped ring, sleeping in poll() whenever it is empty.
+ */
+static int bench_ring(int nsensors, double secs, struct bench_result *res)
+{
+	const struct lunix_record *rec;
+	struct lunix_ring ring;
+	struct pollfd pfd;
+	uint64_t head, tail;
+	double end, left, lat;
+	int fd;
+
+	if ((fd = open_all(nsensors, O_RDWR)) < 0)
+		return -1;
+	if (lunix_ring_map(fd, &ring) < 0) {
+		perror("mmap");
+		return -1;
+	}
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	end = now_sec() + secs;
+	while ((left = end - now_sec()) > 0) {
+		tail = lunix_ring_tail(&ring);
+		head = lunix_ring_head(&ring);
+		if (head == tail) {
+			res->calls++;
+			if (poll(&pfd, 1, (int)(left * 1000) + 1) < 0 && errno != EINTR) {
+				perror("poll");
+				return -1;
+			}
+			continue;
+		}
+
+		res->reads++;
+		for (; tail != head; tail++) {
+			rec = lunix_ring_record(&ring, tail);
+			lat = now_sec() - rec->timestamp / 1e9;
+			res->bytes += sizeof(*rec);
+			res->lat_cnt++;
+			res->lat_sum += lat;
+			if (lat > res->lat_max)
+				res->lat_max = lat;
+		}
+		lunix_ring_consume(&ring, tail);
+	}
+
+	lunix_ring_unmap(&ring);
+	close(fd);
+	return 0;
+}
+
+static struct {
+	const char *name;
+	const char *arg;
+	int (*fn)(int n, double secs, struct bench_result *res);
+} benches[] = {
+	{ "spin",	"NSENSORS",	bench_spin	},
+	{ "epoll",	"NSENSORS",	bench_epoll	},
+	{ "readers",	"NREADERS",	bench_readers	},
+	{ "shared",	"NREADERS",	bench_shared	},
+	{ "blocking",	"NSENSORS",	bench_blocking	},
+	{ "all",	"NSENSORS",	bench_all	},
+	{ "ring",	"NSENSORS",	bench_ring	},
+	{ NULL,		NULL,		NULL		}
+};
+
+static void usage(const char *argv0)
+{
+	int i;
+
+	fprintf(stderr, "Usage: %s BENCH [SECONDS] [N]\n\nBENCH [N] is one of:\n", argv0);
+	for (i = 0; benches[i].name; i++)
+		fprintf(stderr, "\t%s [%s]\n", benches[i].name, benches[i].arg);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench_result res;
+	struct rusage ru, cru;
+	double secs, start, wall, user, sys;
+	int i, n;
+
+	if (argc < 2)
+		usage(argv[0]);
+	secs = (argc > 2) ? atof(argv[2]) : 10.0;
+	n = (argc > 3) ? atoi(argv[3]) : 16;
+	if (secs <= 0 || n < 1)
+		usage(argv[0]);
+
+	for (i = 0; benches[i].name; i++)
+		if (!strcmp(benches[i].name, argv[1]))
+			break;
+	if (!benches[i].name)
+		usage(argv[0]);
+
+	memset(&res, 0, sizeof(res));
+	start = now_sec();
+	if (benches[i].fn(n, secs, &res) < 0)
+		return 1;
+	wall = now_sec() - start;
+
+	getrusage(RUSAGE_SELF, &ru);
+	getrusage(RUSAGE_CHILDREN, &cru);
+	user = tv_sec(&ru.ru_utime) + tv_sec(&cru.ru_utime);
+	sys = tv_sec(&ru.ru_stime) + tv_sec(&cru.ru_stime);
+
+	printf("%s: N = %d, %.1f s wall, %.3f s user, %.3f s sys, CPU %.1f%%\n",
+		benches[i].name, n, wall, user, sys, 100.0 * (user + sys) / wall);
+	printf("%s: %lu read() calls, %lu with data, %lu bytes\n",
+		benches[i].name, res.calls, res.reads, res.bytes);
+	if (res.lat_cnt)
+		printf("%s: update-to-read latency avg %.1f us, max %.1f us\n",
+			benches[i].name, 1e6 * res.lat_sum / res.lat_cnt, 1e6 * res.lat_max);
+
+	return 0;
+}
@@ -15,6 +15,8 @@
 #include <linux/list.h>
 #include <linux/cdev.h>
 #include <linux/poll.h>
+#include <linux/device.h>
+#include <linux/uio.h>
 #include <linux/slab.h>
 #include <linux/sched.h>
 #include <linux/ioctl.h>
@@ -23,17 +25,52 @@
 #include <linux/kernel.h>
 #include <linux/mmzone.h>
 #include <linux/vmalloc.h>
+#include <linux/xarray.h>
 #include <linux/spinlock.h>
+#include <linux/workqueue.h>
 
 #include "lunix.h"
 #include "lunix-chrdev.h"
-#include "lunix-lookup.h"
 
 /*
  * Global data
  */
 struct cdev lunix_chrdev_cdev;
 
+/*
+ * The device nodes of sensors are created through the driver
+ * core as the sensors appear, see lunix_chrdev_sensor_added()
+ */
+static struct class *lunix_chrdev_class;
+static int lunix_chrdev_devices_on;		/* Under lunix_chrdev_devices_lock */
+static DEFINE_SPINLOCK(lunix_chrdev_devices_lock);
+static void lunix_chrdev_devices_fn(struct work_struct *work);
+static DECLARE_WORK(lunix_chrdev_devices_work, lunix_chrdev_devices_fn);
+
+static const char * const lunix_chrdev_msr_names[N_LUNIX_MSR] = { "batt", "temp", "light" };
+
+/*
+ * The cursor an open file consumes samples from: its own,
+ * or the one shared by its consumer group.
+ */
+static inline atomic64_t *lunix_chrdev_state_cursor(struct lunix_chrdev_state_struct *state)
+{
+	struct lunix_msr_group_struct *group = READ_ONCE(state->group);
+
+	return group ? &group->seq : &state->hist_seq;
+}
+
+/*
+ * The wait queue an open file sleeps on for new samples
+ */
+static inline wait_queue_head_t *lunix_chrdev_state_wq(struct lunix_chrdev_state_struct *state)
+{
+	struct lunix_msr_group_struct *group = READ_ONCE(state->group);
+
+	if(READ_ONCE(state->filter.flags)) return &state->filter.wq;
+	return group ? &group->wq : &state->sensor->wq[state->type];
+}
+
 /*
  * Just a quick [unlocked] check to see if the cached
  * chrdev state needs to be updated from sensor measurements.
@@ -45,99 +82,240 @@ static int lunix_chrdev_state_needs_refresh(struct lunix_chrdev_state_struct *st
 	
 	WARN_ON ( !(sensor = state->sensor));
 
-	// If sensor last update is not the same as the timestamp on the chrdev struct, then we need to update
-	return (sensor->msr_data[state->type]->last_update != state->buf_timestamp);
+	// A filtered file only cares about samples that passed its filter
+	if(READ_ONCE(state->filter.flags))
+		return READ_ONCE(state->filter.pass_seq) > atomic64_read(lunix_chrdev_state_cursor(state));
+
+	// If the sensor has a newer sample than the last one we consumed, then we need to update
+	return (READ_ONCE(sensor->msr_seq[state->type]) != atomic64_read(lunix_chrdev_state_cursor(state)));
 }
 
 /*
- * Updates the cached state of a character device
- * based on sensor data. Must be called with the
- * character device state lock held.
+ * Sleep until there are samples this file has not consumed, or
+ * until it has moved to another wait queue, so that the caller
+ * retries and goes to sleep on the right one.
+ * Must be called without the character device state lock held.
  */
-static int lunix_chrdev_state_update(struct lunix_chrdev_state_struct *state)
+static int lunix_chrdev_state_wait(struct lunix_chrdev_state_struct *state)
 {
-	struct lunix_sensor_struct __attribute__((unused)) *sensor;
-	struct lunix_msr_data_struct *new_data_raw;
-	long new_data;
-	int i = 0;
-	uint16_t *temp;
+	wait_queue_head_t *wq = lunix_chrdev_state_wq(state);
 
-	sensor = state->sensor;
+	debug("Going to sleep");
+	if(state->group) {
+		// Only one group member is woken up per update
+		return wait_event_interruptible_exclusive(*wq, (lunix_chrdev_state_needs_refresh(state) || lunix_chrdev_state_wq(state) != wq));
+	}
+	return wait_event_interruptible(*wq, (lunix_chrdev_state_needs_refresh(state) || lunix_chrdev_state_wq(state) != wq));
+}
 
-	/*
-	 * Grab the raw data quickly, hold the
-	 * spinlock for as little as possible.
-	 */
-	spin_lock(&sensor->lock);
+/*
+ * Samples copied out of the ring but not claimed yet: committing
+ * moves the cursor from tail to next, if no other reader of the
+ * same cursor moved it first, and the filter reference to ref.
+ */
+struct lunix_chrdev_peek {
+	uint64_t tail, from, next;	/* from > tail if samples were lost */
+	struct lunix_filter_ref ref;
+};
 
-	new_data_raw = sensor->msr_data[state->type];
+/*
+ * Copy up to max of the oldest unread samples to snap, without
+ * claiming them, and return their number. No lock is taken: the
+ * samples are copied under the seqcount of the ring, retrying if
+ * an update raced with us.
+ */
+static int lunix_chrdev_peek(struct lunix_chrdev_state_struct *state,
+	struct lunix_msr_sample_struct *snap, int max, struct lunix_chrdev_peek *pk)
+{
+	struct lunix_sensor_struct *sensor = state->sensor;
+	struct lunix_msr_sample_struct *ring = sensor->hist[state->type];
+	seqcount_t *seqc = &sensor->hist_seqc[state->type];
+	uint64_t head, from;
+	unsigned int seq;
+	int n;
+
+	pk->tail = atomic64_read(lunix_chrdev_state_cursor(state));
+	do {
+		seq = read_seqcount_begin(seqc);
+		head = READ_ONCE(sensor->msr_seq[state->type]);
+
+		// If the ring wrapped around since our last read, the oldest samples are gone
+		from = pk->tail;
+		if(head - from > lunix_sensor_hist) from = head - lunix_sensor_hist;
+
+		// Samples from+1 .. head are the unread ones
+		for(n = 0; n < max && from + n != head; n++)
+			snap[n] = ring[(from + n + 1) & (lunix_sensor_hist - 1)];
+	} while(read_seqcount_retry(seqc, seq));
+
+	pk->from = from;
+	pk->next = from + n;
+	return n;
+}
 
-	spin_unlock(&sensor->lock);
+/*
+ * Claim what was peeked by moving the cursor past it with cmpxchg.
+ * Fails if another reader of the same cursor got there first, in
+ * which case the caller peeks again. So each sample goes to exactly
+ * one of them, and only once it has been handed out.
+ */
+static int lunix_chrdev_commit(struct lunix_chrdev_state_struct *state, struct lunix_chrdev_peek *pk)
+{
+	if(atomic64_cmpxchg(lunix_chrdev_state_cursor(state), pk->tail, pk->next) != pk->tail) return 0;
 
-	// If no new data just return with error
-	if(state->buf_timestamp == new_data_raw->last_update) return -EAGAIN;
+	if(pk->from != pk->tail) debug("Reader fell behind, lost %llu samples", (unsigned long long)(pk->from - pk->tail));
+	return 1;
+}
 
-	/*
-	 * Now we can take our time to format them,
-	 * holding only the private state semaphore
-	 */
+/*
+ * Peek at up to max of the oldest unread samples, copying them to
+ * hist_snap, and return the number of them the filter, if any, lets
+ * through; the rest are consumed without being copied, on commit.
+ * Must be called with the character device state lock held.
+ */
+static int lunix_chrdev_state_peek(struct lunix_chrdev_state_struct *state, int max, struct lunix_chrdev_peek *pk)
+{
+	struct lunix_msr_filter_struct *filter;
+	int i, n, kept;
 
-	if(state->mode == CHRDEV_MODE_COOKED) {
-		// Return the formatted decimal numbers
+	n = lunix_chrdev_peek(state, state->hist_snap, max, pk);
 
-		// First, get measurement
-		if(state->type == BATT) new_data = lookup_voltage[new_data_raw->values[0]];
-		else if(state->type == TEMP) new_data = lookup_temperature[new_data_raw->values[0]];
-		else new_data = lookup_light[new_data_raw->values[0]];
+	filter = state->filter.flags ? &state->filter : NULL;
+	if(!filter) return n;
 
-		debug("Received number %ld", new_data);
+	pk->ref = state->filter_ref;
+	for(i = kept = 0; i < n; i++)
+		if(lunix_filter_pass(filter, &pk->ref, &state->hist_snap[i]))
+			state->hist_snap[kept++] = state->hist_snap[i];
 
-		// Update the timestamp in state
-		state->buf_timestamp = new_data_raw->last_update;
+	return kept;
+}
 
-		if(new_data < 0) {
-			state->buf_data[(state->buf_lim)++] = '-';
-			new_data = -1 * new_data;
-		}
+static int lunix_chrdev_state_commit(struct lunix_chrdev_state_struct *state, struct lunix_chrdev_peek *pk)
+{
+	if(!lunix_chrdev_commit(state, pk)) return 0;
 
-		for(i = 0; i < 3; i++) {
-			state->buf_data[state->buf_lim + 5 - i] = '0' + new_data%10;
-			new_data /= 10;
-		}
+	if(state->filter.flags) state->filter_ref = pk->ref;
+	return 1;
+}
 
-		state->buf_data[state->buf_lim + 2] = '.';
-		for(i = 0; i < 2; i++) {
-			state->buf_data[state->buf_lim + 1 - i] = '0' + new_data%10;
-			new_data /= 10;
-		}
+/*
+ * Consume up to max of the oldest unread samples, copying them
+ * to hist_snap, and return their number, like the above in one go.
+ * Must be called with the character device state lock held.
+ */
+static int lunix_chrdev_state_snapshot(struct lunix_chrdev_state_struct *state, int max)
+{
+	struct lunix_chrdev_peek pk;
+	int n;
 
-		state->buf_lim += 6;
+	do {
+		n = lunix_chrdev_state_peek(state, max, &pk);
+	} while(!lunix_chrdev_state_commit(state, &pk));
 
-		while(state->buf_lim % 10) {
-			state->buf_data[state->buf_lim++] = ' ';
-		}
-	} else{
-		// Just return the raw 16-bit values
+	return n;
+}
 
-		// First, get measurement
-		if(state->type == BATT) new_data = new_data_raw->values[0];
-		else if(state->type == TEMP) new_data = new_data_raw->values[0];
-		else new_data = new_data_raw->values[0];
+/*
+ * Append n samples to buf, as formatted cooked values
+ * or raw 16-bit ones, and return the bytes written.
+ * Cooked values were already formatted by the
+ * update path, once for all readers.
+ */
+static int lunix_chrdev_format(unsigned char *buf, const struct lunix_msr_sample_struct *smp, int n, int mode)
+{
+	int i, len = 0;
 
-		debug("Received number %ld", new_data);
+	for(i = 0; i < n; i++) {
+		if(mode == CHRDEV_MODE_COOKED) {
+			// Append the formatted decimal number
+			debug("Received number %d", smp[i].cooked);
 
-		// Update the timestamp in state
-		state->buf_timestamp = new_data_raw->last_update;
+			memcpy(buf + len, smp[i].text, LUNIX_CHRDEV_RECSZ);
+			len += LUNIX_CHRDEV_RECSZ;
+		} else{
+			// Just append the raw 16-bit value
+			debug("Received number %u", smp[i].value);
 
-		// Set the first 16 bytes of the buffer equal to the raw data
-		temp = (uint16_t *) state->buf_data;
-		*temp = (uint16_t) new_data;
-		state->buf_lim = 2;
+			*(uint16_t *) (buf + len) = (uint16_t) smp[i].value;
+			len += 2;
+		}
 	}
 
+	return len;
+}
+
+static inline int lunix_chrdev_recsz(int mode)
+{
+	return (mode == CHRDEV_MODE_COOKED) ? LUNIX_CHRDEV_RECSZ : 2;
+}
+
+/*
+ * Updates the cached state of a character device
+ * based on sensor data. Must be called with the
+ * character device state lock held.
+ */
+static int lunix_chrdev_state_update(struct lunix_chrdev_state_struct *state)
+{
+	int n;
+
+	n = lunix_chrdev_state_snapshot(state, lunix_sensor_hist);
+
+	// If no new data just return with error
+	if(!n) return -EAGAIN;
+
+	// Now we can take our time to copy them out, holding only the private state semaphore
+	state->buf_lim = lunix_chrdev_format(state->buf_data, state->hist_snap, n, state->mode);
+
 	return 0;
 }
 
+/*
+ * The lock-free read path: hand out only as many whole samples as fit
+ * in the reader's buffer, so that nothing is ever left over to keep
+ * in the private state for the next read. Up to a whole history ring
+ * of them is handed out per call, like the locked path does, a few at
+ * a time through a small buffer on the stack. Each few are copied to
+ * the reader before they are claimed, and taken back from the iterator
+ * if another reader claimed them first, so a fault loses nothing.
+ * Neither the state semaphore nor the sensor spinlock is taken; must
+ * be called with cfg_lock held for reading, so that the group and the
+ * filter stay put. Returns 0 if there was nothing to hand out.
+ */
+static ssize_t lunix_chrdev_read_fast(struct lunix_chrdev_state_struct *state, struct iov_iter *to, int mode)
+{
+	struct lunix_msr_sample_struct snap[LUNIX_CHRDEV_FAST_SAMPLES];
+	unsigned char buf[LUNIX_CHRDEV_FAST_SAMPLES * LUNIX_CHRDEV_RECSZ];
+	struct lunix_chrdev_peek pk;
+	size_t max, done, copied;
+	int n, len;
+
+	max = min_t(size_t, iov_iter_count(to) / lunix_chrdev_recsz(mode), lunix_sensor_hist);
+
+	for(done = 0; done < max; done += n) {
+		n = lunix_chrdev_peek(state, snap, min_t(size_t, max - done, LUNIX_CHRDEV_FAST_SAMPLES), &pk);
+		if(!n) break;
+
+		len = lunix_chrdev_format(buf, snap, n, mode);
+		copied = copy_to_iter(buf, len, to);
+		if(copied != (size_t)len) {
+			// Not claimed, so the next read gets them again
+			debug("Error copying to userspace");
+			iov_iter_revert(to, copied);
+			if(!done) return -EFAULT;
+			break;
+		}
+
+		if(!lunix_chrdev_commit(state, &pk)) {
+			// Another reader of the cursor claimed them, look again
+			iov_iter_revert(to, len);
+			n = 0;
+		}
+	}
+
+	return done * lunix_chrdev_recsz(mode);
+}
+
 /*************************************
  * Implementation of file operations
  * for the Lunix character device
@@ -161,6 +339,7 @@ static int lunix_chrdev_open(struct inode *inode, struct file *filp)
 	 * the minor number of the device node [/dev/sensor<NO>-<TYPE>]
 	 */
 	imnr = iminor(inode);
+	if(imnr % 8 >= N_LUNIX_MSR || (imnr >> 3) >= lunix_sensor_cnt) return -ENODEV;
 	
 	// Allocate a new Lunix character device private state structure
 	chrdv = kmalloc(sizeof(struct lunix_chrdev_state_struct), GFP_KERNEL);
@@ -169,11 +348,43 @@ static int lunix_chrdev_open(struct inode *inode, struct file *filp)
 		return -ENOMEM;
 	}
 	chrdv->type = imnr%8; // Last 3 bits of minor number indicate measurement type
-	chrdv->sensor = &lunix_sensors[imnr>>3];
+
+	// Only sensors heard from exist, opening a node must not bring one into existence
+	chrdv->sensor = lunix_sensor_get(imnr>>3);
+	if(!chrdv->sensor) {
+		kfree(chrdv);
+		return -ENODEV;
+	}
 	chrdv->buf_lim = 0;
-	chrdv->buf_timestamp = 0;
+	chrdv->buf_pos = 0;
+
+	// Room for a whole history ring, whether formatted or raw
+	chrdv->buf_data = kmalloc(lunix_sensor_hist * LUNIX_CHRDEV_RECSZ, GFP_KERNEL);
+	chrdv->hist_snap = kmalloc_array(lunix_sensor_hist, sizeof(*chrdv->hist_snap), GFP_KERNEL);
+	if(!chrdv->buf_data || !chrdv->hist_snap) {
+		debug("Failed to allocate character device buffers");
+		kfree(chrdv->buf_data);
+		kfree(chrdv->hist_snap);
+		kfree(chrdv);
+		return -ENOMEM;
+	}
+
+	// Start from the latest sample, so that the first read reports the current value
+	spin_lock(&chrdv->sensor->lock);
+	atomic64_set(&chrdv->hist_seq, chrdv->sensor->msr_seq[chrdv->type]);
+	if(atomic64_read(&chrdv->hist_seq)) atomic64_dec(&chrdv->hist_seq);
+	spin_unlock(&chrdv->sensor->lock);
+
 	sema_init(&chrdv->lock, 1);
+	init_rwsem(&chrdv->cfg_lock);
+	// read_iter never blocks when asked not to, so io_uring need not punt reads to a worker
+	filp->f_mode |= FMODE_NOWAIT;
 	chrdv->mode = CHRDEV_MODE_COOKED;
+	chrdv->group = NULL;
+	chrdv->polled = 0;
+	chrdv->filter.flags = 0;
+	INIT_LIST_HEAD(&chrdv->filter.list);
+	init_waitqueue_head(&chrdv->filter.wq);
 	filp->private_data = chrdv;
 	
 	ret = 0;
@@ -182,15 +393,184 @@ out:
 	return ret;
 }
 
+/*
+ * Move an open file into consumer group g of its measurement,
+ * leaving any group it was in. g = 0 means no group.
+ */
+static int lunix_chrdev_state_set_group(struct lunix_chrdev_state_struct *state, unsigned long g)
+{
+	struct lunix_sensor_struct *sensor = state->sensor;
+	struct lunix_msr_group_struct *group;
+	wait_queue_head_t *old_wq;
+
+	if(g > LUNIX_MSR_GROUPS) return -EINVAL;
+
+	spin_lock(&sensor->lock);
+
+	if(state->filter.flags && g) {
+		spin_unlock(&sensor->lock);
+		return -EBUSY;
+	}
+	old_wq = lunix_chrdev_state_wq(state);
+
+	if(state->group) {
+		// Stay where the group was, rather than replay what it already consumed
+		atomic64_set(&state->hist_seq, atomic64_read(&state->group->seq));
+		state->group->members--;
+	}
+
+	group = g ? &sensor->groups[state->type][g - 1] : NULL;
+	if(group && !group->members++) {
+		// First member in, the group starts where we are
+		atomic64_set(&group->seq, atomic64_read(&state->hist_seq));
+	}
+	WRITE_ONCE(state->group, group);
+
+	spin_unlock(&sensor->lock);
+
+	// Readers of this file asleep on the old queue should move over
+	if(lunix_chrdev_state_wq(state) != old_wq) wake_up_interruptible_all(old_wq);
+
+	return 0;
+}
+
+/*
+ * Set the filter of an open file, or remove it if pred->flags is 0.
+ * A new filter starts from the latest sample, skipping the backlog,
+ * with the reader and the update path agreeing on where it stands.
+ */
+static int lunix_chrdev_state_set_filter(struct lunix_chrdev_state_struct *state, struct lunix_filter *pred)
+{
+	struct lunix_sensor_struct *sensor = state->sensor;
+	struct lunix_msr_filter_struct *filter = &state->filter;
+	struct lunix_msr_sample_struct *latest;
+	wait_queue_head_t *old_wq;
+	uint64_t head;
+
+	if(pred->flags & ~(LUNIX_FILTER_CROSS | LUNIX_FILTER_DELTA | LUNIX_FILTER_INTERVAL | LUNIX_FILTER_EVERY)) return -EINVAL;
+	if((pred->flags & LUNIX_FILTER_CROSS) && pred->low > pred->high) return -EINVAL;
+	if((pred->flags & LUNIX_FILTER_DELTA) && pred->delta <= 0) return -EINVAL;
+	if((pred->flags & LUNIX_FILTER_INTERVAL) && !pred->interval_ms) return -EINVAL;
+	if((pred->flags & LUNIX_FILTER_EVERY) && !pred->every) return -EINVAL;
+
+	spin_lock(&sensor->lock);
+
+	if(state->group && pred->flags) {
+		spin_unlock(&sensor->lock);
+		return -EBUSY;
+	}
+	old_wq = lunix_chrdev_state_wq(state);
+
+	if(filter->flags) list_del_init(&filter->list);
+
+	filter->low = pred->low;
+	filter->high = pred->high;
+	filter->delta = pred->delta;
+	filter->interval_ns = (uint64_t)pred->interval_ms * NSEC_PER_MSEC;
+	filter->every = pred->every;
+	filter->pass_seq = 0;
+	filter->kick = 0;
+
+	if(pred->flags) {
+		head = sensor->msr_seq[state->type];
+		atomic64_set(&state->hist_seq, head);
+
+		// Nothing delivered yet, so the first sample to qualify is not held back
+		filter->ref.zone = 0;
+		filter->ref.last = 0;
+		filter->ref.last_ns = 0;
+		filter->ref.count = 0;
+		if(head) {
+			latest = &sensor->hist[state->type][head & (lunix_sensor_hist - 1)];
+			filter->ref.zone = lunix_filter_zone(filter, latest->cooked);
+			filter->ref.last = latest->cooked;
+		}
+		state->filter_ref = filter->ref;
+
+		list_add_tail(&filter->list, &sensor->filters[state->type]);
+	}
+	WRITE_ONCE(filter->flags, pred->flags);
+
+	spin_unlock(&sensor->lock);
+
+	if(lunix_chrdev_state_wq(state) != old_wq) wake_up_interruptible_all(old_wq);
+
+	return 0;
+}
+
 static int lunix_chrdev_release(struct inode *inode, struct file *filp)
 {
-	kfree(filp->private_data);
+	struct lunix_chrdev_state_struct *state = filp->private_data;
+	struct lunix_filter none = { 0 };
+
+	lunix_chrdev_state_set_filter(state, &none);
+	lunix_chrdev_state_set_group(state, 0);
+	kfree(state->buf_data);
+	kfree(state->hist_snap);
+	kfree(state);
 	return 0;
 }
 
+/*
+ * Hand up to samples.count of the oldest unread samples to userspace
+ * as struct lunix_record, consuming them like read() would,
+ * sleeping until there is at least one.
+ */
+static long lunix_chrdev_get_samples(struct file *filp, struct lunix_chrdev_state_struct *state,
+	struct lunix_samples __user *usamples)
+{
+	struct lunix_samples samples;
+	struct lunix_chrdev_peek pk;
+	struct lunix_record rec;
+	struct lunix_record __user *urecs;
+	long ret;
+	int i, n;
+
+	if(copy_from_user(&samples, usamples, sizeof(samples))) return -EFAULT;
+	if(!samples.count) return -EINVAL;
+	urecs = (struct lunix_record __user *)(unsigned long)samples.records;
+
+	if(down_interruptible(&state->lock)) return -ERESTARTSYS;
+
+	/*
+	 * Hand the samples out before claiming them, so that a fault
+	 * leaves them unread. If another reader of the same cursor
+	 * claimed them meanwhile, start over with what is left.
+	 */
+	for(;;) {
+		n = lunix_chrdev_state_peek(state, min_t(uint32_t, samples.count, lunix_sensor_hist), &pk);
+
+		ret = -EFAULT;
+		for(i = 0; i < n; i++) {
+			lunix_record_fill(&rec, state->sensor, state->type, &state->hist_snap[i]);
+			if(copy_to_user(&urecs[i], &rec, sizeof(rec))) goto out;
+		}
+		if(n && put_user(n, &usamples->count)) goto out;
+
+		if(!lunix_chrdev_state_commit(state, &pk)) continue;
+		if(n) break;
+		// The filter dropped all of them, see if there are more
+		if(pk.next != pk.tail) continue;
+
+		up(&state->lock);
+
+		if(filp->f_flags & O_NONBLOCK) return -EAGAIN;
+		if(lunix_chrdev_state_wait(state)) return -ERESTARTSYS;
+
+		if(down_interruptible(&state->lock)) return -ERESTARTSYS;
+	}
+	ret = 0;
+
+out:
+	up(&state->lock);
+	return ret;
+}
+
 static long lunix_chrdev_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
 	struct lunix_chrdev_state_struct *state;
+	struct lunix_filter filter;
+	struct lunix_aggr aggr;
 	int ret = 0;
 
 	state = filp->private_data;
@@ -198,10 +578,49 @@ static long lunix_chrdev_ioctl(struct file *filp, unsigned int cmd, unsigned lon
 	
 	switch(cmd) {
 		case LUNIX_IOC_MODE:
-			if(arg == CHRDEV_MODE_RAW || arg == CHRDEV_MODE_COOKED) {
+			if(arg != CHRDEV_MODE_RAW && arg != CHRDEV_MODE_COOKED) return -ENOTTY;
+			// Neither a reader mid-read nor the cached buffer may mix up the two formats
+			if(down_interruptible(&state->lock)) return -ERESTARTSYS;
+			down_write(&state->cfg_lock);
+			if(state->mode != arg) {
+				// What is cached is in the old format, drop it
+				state->buf_lim = 0;
+				state->buf_pos = 0;
 				state->mode = arg;
-				ret = 0;
-			}else ret = -ENOTTY;
+			}
+			up_write(&state->cfg_lock);
+			up(&state->lock);
+			break;
+		case LUNIX_IOC_GROUP:
+			// Do not switch cursors under the feet of a reader, locked or lock-free
+			if(down_interruptible(&state->lock)) return -ERESTARTSYS;
+			down_write(&state->cfg_lock);
+			// Pollers would be left behind on the old wait queue
+			if(state->polled) ret = -EBUSY;
+			else ret = lunix_chrdev_state_set_group(state, arg);
+			up_write(&state->cfg_lock);
+			up(&state->lock);
+			break;
+		case LUNIX_IOC_GET_SAMPLES:
+			ret = lunix_chrdev_get_samples(filp, state, (struct lunix_samples __user *)arg);
+			break;
+		case LUNIX_IOC_GET_AGGR:
+			if(copy_from_user(&aggr, (void __user *)arg, sizeof(aggr))) return -EFAULT;
+			lunix_sensor_aggr(state->sensor, state->type, aggr.window_ms, &aggr);
+			if(copy_to_user((void __user *)arg, &aggr, sizeof(aggr))) return -EFAULT;
+			break;
+		case LUNIX_IOC_SET_FILTER:
+			if(copy_from_user(&filter, (void __user *)arg, sizeof(filter))) return -EFAULT;
+			if(down_interruptible(&state->lock)) return -ERESTARTSYS;
+			down_write(&state->cfg_lock);
+			// Pollers would be left behind on the old wait queue
+			if(state->polled) ret = -EBUSY;
+			else ret = lunix_chrdev_state_set_filter(state, &filter);
+			up_write(&state->cfg_lock);
+			up(&state->lock);
+			break;
+		case LUNIX_IOC_MSR_OFFSET:
+			ret = put_user((uint32_t)offset_in_page(state->sensor->msr_data[state->type]), (uint32_t __user *)arg);
 			break;
 		default:
 			ret = -ENOTTY;
@@ -209,10 +628,31 @@ static long lunix_chrdev_ioctl(struct file *filp, unsigned int cmd, unsigned lon
 	return ret;
 }
 
-static ssize_t lunix_chrdev_read(struct file *filp, char __user *usrbuf, size_t cnt, loff_t *f_pos)
+/*
+ * Reads are implemented through read_iter, so that io_uring can
+ * issue them with IOCB_NOWAIT: then nothing may block, neither on
+ * the state semaphore nor waiting for data, and -EAGAIN tells the
+ * caller to retry once poll() says the node is readable. Plain
+ * O_NONBLOCK reads keep returning 0 when there is no new data.
+ *
+ * Readers whose buffer holds whole samples take the lock-free path,
+ * so that e.g. forked readers sharing a file do not serialize on the
+ * private state semaphore [they only share the read side of cfg_lock].
+ * The rest go through the cached buffer, whose position is kept in the
+ * private state rather than in ki_pos, which io_uring sets from the
+ * submission.
+ *
+ * splice() goes through here too [generic_file_splice_read() hands
+ * us a pipe-backed iov_iter], so a relay can move the stream into
+ * a pipe and on to a socket without copying it through userspace.
+ */
+static ssize_t lunix_chrdev_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
 	ssize_t ret;
+	size_t cnt;
+	int nowait, mode;
 
+	struct file *filp = iocb->ki_filp;
 	struct lunix_sensor_struct *sensor;
 	struct lunix_chrdev_state_struct *state;
 
@@ -222,52 +662,75 @@ static ssize_t lunix_chrdev_read(struct file *filp, char __user *usrbuf, size_t
 	sensor = state->sensor;
 	WARN_ON(!sensor);
 
+	cnt = iov_iter_count(to);
+	nowait = iocb->ki_flags & IOCB_NOWAIT;
+
+	/*
+	 * Whole samples go straight from the rings to the reader without
+	 * the state semaphore, unless a previous read left part of the buffer
+	 * behind, or a filter is set [its reference is kept under the lock],
+	 * or the reader asked for less than a sample. The filter and the mode
+	 * are checked under cfg_lock, which the ioctls changing them take
+	 * for writing.
+	 */
+	while(!READ_ONCE(state->buf_lim)) {
+		if(nowait) {
+			if(!down_read_trylock(&state->cfg_lock)) return -EAGAIN;
+		}else down_read(&state->cfg_lock);
+
+		mode = state->mode;
+		if(state->filter.flags || cnt < lunix_chrdev_recsz(mode)) {
+			up_read(&state->cfg_lock);
+			break;
+		}
+		ret = lunix_chrdev_read_fast(state, to, mode);
+		up_read(&state->cfg_lock);
+		if(ret) return ret;
+
+		if(nowait) return -EAGAIN;
+		if(filp->f_flags & O_NONBLOCK) return 0;
+		if(lunix_chrdev_state_wait(state)) return -ERESTARTSYS;
+	}
+
 	// Only one device should be reading at a given moment, so we have to get the lock first
-	if(down_interruptible(&state->lock)) return -ERESTARTSYS;
+	if(nowait) {
+		if(down_trylock(&state->lock)) return -EAGAIN;
+	}else if(down_interruptible(&state->lock)) return -ERESTARTSYS;
 
 	/*
 	 * If the cached character device state needs to be
 	 * updated by actual sensor data (i.e. we need to report
-	 * on a "fresh" measurement, do so
+	 * on "fresh" measurements), do so. A single update
+	 * collects the whole unread backlog.
 	 */
-	if (*f_pos == 0) {
+	if (!state->buf_lim) {
 		while (lunix_chrdev_state_update(state) == -EAGAIN) {
 			// There was no new data. We should either leave or go to sleep until there is and retry later.
 			// Either way we have to unlock.
 			up(&state->lock);
 
+			if(nowait) return -EAGAIN;
 			if(filp->f_flags & O_NONBLOCK) return 0; // If O_NONBLOCK is chosen, we should just leave
 
-			debug("Going to sleep");
-			if(wait_event_interruptible(sensor->wq, (lunix_chrdev_state_needs_refresh(state)))) return -ERESTARTSYS;
+			if(lunix_chrdev_state_wait(state)) return -ERESTARTSYS;
 
 			debug("Waking up");
 			if(down_interruptible(&state->lock)) return -ERESTARTSYS;
 		}
 	}
 
-	if(*f_pos + cnt < state->buf_lim) {
-		// If we do not consume entire measurement, just move pointer to start of unread and get out
-		if(copy_to_user(usrbuf, state->buf_data + *f_pos, cnt)) {
-			debug("Error copying to userspace, <");
-			ret = -EFAULT;
-			goto out;
-		}
-
-		ret = cnt;
-
-		*f_pos += cnt;
-	}else {
-		// If we want more than the rest of the measurement, return all the bytes left and reset f_pos
-		if(copy_to_user(usrbuf, state->buf_data + *f_pos, state->buf_lim - *f_pos)) {
-			debug("Error copying to userspace, >=");
-			ret = -EFAULT;
-			goto out;
-		}
-
-		ret = state->buf_lim - *f_pos;
+	// Hand out what is left of the cached buffer, or as much of it as fits
+	ret = min_t(size_t, cnt, state->buf_lim - state->buf_pos);
+	if(copy_to_iter(state->buf_data + state->buf_pos, ret, to) != ret) {
+		debug("Error copying to userspace");
+		ret = -EFAULT;
+		goto out;
+	}
 
-		*f_pos = 0;
+	state->buf_pos += ret;
+	if(state->buf_pos == state->buf_lim) {
+		// Consumed the entire measurement, next read fetches fresh data
+		state->buf_pos = 0;
 		state->buf_lim = 0;
 	}
 
@@ -277,17 +740,67 @@ out:
 	return ret;
 }
 
+/*
+ * Report the node readable whenever a read() would not block:
+ * either unread samples [that passed the filter, if any] are
+ * waiting in the sensor rings, or a previous read left part
+ * of the buffer unconsumed.
+ */
+static unsigned int lunix_chrdev_poll(struct file *filp, poll_table *wait)
+{
+	struct lunix_chrdev_state_struct *state;
+	unsigned int mask = 0;
+
+	state = filp->private_data;
+	WARN_ON(!state);
+
+	// The wait queue must not change from under the registration
+	down_read(&state->cfg_lock);
+	WRITE_ONCE(state->polled, 1);
+	poll_wait(filp, lunix_chrdev_state_wq(state), wait);
+	up_read(&state->cfg_lock);
+
+	if(state->buf_lim || lunix_chrdev_state_needs_refresh(state))
+		mask |= POLLIN | POLLRDNORM;
+
+	return mask;
+}
+
+/*
+ * Map the page holding the measurement record, or a part of the
+ * packed table, see LUNIX_MSR_TABLE_OFFSET in lunix-chrdev.h.
+ * Read-only, and never to become writable through mprotect(): the
+ * records are shared with every other reader [with the packed layout,
+ * those of other sensors too], and a scribbled seq would keep their
+ * lunix_msr_snapshot() spinning.
+ */
 static int lunix_chrdev_mmap(struct file *filp, struct vm_area_struct *vma)
 {
 	struct lunix_chrdev_state_struct *state;
 	struct lunix_sensor_struct *sensor;
 	struct lunix_msr_data_struct *msr_data;
-	unsigned long pfn;
+	unsigned long pfn, table_pgoff;
 
 	state = filp->private_data;
 	sensor = state->sensor;
 	msr_data = sensor->msr_data[state->type];
 
+	if(vma->vm_flags & VM_WRITE) return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	table_pgoff = LUNIX_MSR_TABLE_OFFSET >> PAGE_SHIFT;
+	if(vma->vm_pgoff >= table_pgoff) {
+		if(!lunix_msr_table) return -EINVAL;
+		// Checks that the mapping does not run past the end of the table
+		return remap_vmalloc_range(vma, lunix_msr_table, vma->vm_pgoff - table_pgoff);
+	}
+
+	// Just the one page, nothing around it
+	if(vma->vm_pgoff || vma->vm_end - vma->vm_start > PAGE_SIZE) return -EINVAL;
+
+	if(lunix_msr_in_table(sensor))
+		return remap_vmalloc_range(vma, lunix_msr_table, lunix_msr_table_offset(sensor, state->type) >> PAGE_SHIFT);
+
 	pfn = page_to_pfn(virt_to_page(msr_data));
 
 	if (remap_pfn_range(vma, vma->vm_start, pfn, vma->vm_end - vma->vm_start, vma->vm_page_prot)) return -EAGAIN;
@@ -300,23 +813,68 @@ static struct file_operations lunix_chrdev_fops =
         .owner          = THIS_MODULE,
 	.open           = lunix_chrdev_open,
 	.release        = lunix_chrdev_release,
-	.read           = lunix_chrdev_read,
+	.read_iter      = lunix_chrdev_read_iter,
+	.splice_read    = generic_file_splice_read,
 	.unlocked_ioctl = lunix_chrdev_ioctl,
+	.poll           = lunix_chrdev_poll,
 	.mmap           = lunix_chrdev_mmap
 };
 
+/*
+ * Create /dev/lunix<NO>-<TYPE> [through devtmpfs or udev] for the
+ * sensors that appeared since the last run. Sensors appear in
+ * atomic context, on their first packet, so this is a work item.
+ */
+static void lunix_chrdev_devices_fn(struct work_struct *work)
+{
+	struct lunix_sensor_struct *s;
+	struct device *dev;
+	unsigned long id;
+	int type;
+
+	xa_for_each_marked(&lunix_sensor_xa, id, s, LUNIX_SENSOR_NEW) {
+		xa_clear_mark(&lunix_sensor_xa, id, LUNIX_SENSOR_NEW);
+		for (type = 0; type < N_LUNIX_MSR; type++) {
+			dev = device_create(lunix_chrdev_class, NULL, MKDEV(LUNIX_CHRDEV_MAJOR, (id << 3) | type),
+				NULL, "lunix%lu-%s", id, lunix_chrdev_msr_names[type]);
+			if (IS_ERR(dev))
+				printk(KERN_WARNING "%s: Error creating device node for sensor %lu, ret = %ld.\n",
+					__FILE__, id, PTR_ERR(dev));
+		}
+	}
+}
+
+/*
+ * Called from the packet path, so the work item is only queued,
+ * under the same lock lunix_chrdev_destroy() turns it off with,
+ * so that none gets queued after it has been cancelled.
+ */
+void lunix_chrdev_sensor_added(void)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&lunix_chrdev_devices_lock, flags);
+	if (lunix_chrdev_devices_on)
+		schedule_work(&lunix_chrdev_devices_work);
+	spin_unlock_irqrestore(&lunix_chrdev_devices_lock, flags);
+}
+
 int lunix_chrdev_init(void)
 {
 	/*
 	 * Register the character device with the kernel, asking for
 	 * a range of minor numbers (number of sensors * 8 measurements / sensor)
-	 * beginning with LINUX_CHRDEV_MAJOR:0
+	 * beginning with LINUX_CHRDEV_MAJOR:0. With 16-bit node ids that
+	 * is up to 2^19 minors, which is why the nodes themselves are only
+	 * created for the sensors actually present.
 	 */
 	int ret;
 	dev_t dev_no;
 	unsigned int lunix_minor_cnt;
 	char name[] = "LUNIX:TNG";
 
+	BUILD_BUG_ON(LUNIX_CHRDEV_RECSZ != LUNIX_MSR_TEXTSZ);
+
 	lunix_minor_cnt = lunix_sensor_cnt << 3;
 	
 	debug("initializing character device\n");
@@ -338,9 +896,24 @@ int lunix_chrdev_init(void)
 		goto out_with_chrdev_region;
 	}
 
+	lunix_chrdev_class = class_create(THIS_MODULE, "lunix");
+	if (IS_ERR(lunix_chrdev_class)) {
+		ret = PTR_ERR(lunix_chrdev_class);
+		debug("failed to create device class\n");
+		goto out_with_cdev;
+	}
+
+	// Catch up with any sensor that appeared before us
+	spin_lock_irq(&lunix_chrdev_devices_lock);
+	lunix_chrdev_devices_on = 1;
+	schedule_work(&lunix_chrdev_devices_work);
+	spin_unlock_irq(&lunix_chrdev_devices_lock);
+
 	debug("completed successfully\n");
 	return 0;
 
+out_with_cdev:
+	cdev_del(&lunix_chrdev_cdev);
 out_with_chrdev_region:
 	unregister_chrdev_region(dev_no, lunix_minor_cnt);
 out:
@@ -351,8 +924,22 @@ void lunix_chrdev_destroy(void)
 {
 	dev_t dev_no;
 	unsigned int lunix_minor_cnt = lunix_sensor_cnt << 3;
+	struct lunix_sensor_struct *s;
+	unsigned long id;
+	int type;
 		
 	debug("entering\n");
+
+	// No more device nodes, then remove those there are
+	spin_lock_irq(&lunix_chrdev_devices_lock);
+	lunix_chrdev_devices_on = 0;
+	spin_unlock_irq(&lunix_chrdev_devices_lock);
+	cancel_work_sync(&lunix_chrdev_devices_work);
+	xa_for_each(&lunix_sensor_xa, id, s)
+		for (type = 0; type < N_LUNIX_MSR; type++)
+			device_destroy(lunix_chrdev_class, MKDEV(LUNIX_CHRDEV_MAJOR, (id << 3) | type));
+	class_destroy(lunix_chrdev_class);
+
 	dev_no = MKDEV(LUNIX_CHRDEV_MAJOR, 0);
 	cdev_del(&lunix_chrdev_cdev);
 	unregister_chrdev_region(dev_no, lunix_minor_cnt);
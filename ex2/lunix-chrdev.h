@@ -14,18 +14,20 @@
  * Lunix:TNG character device
  */
 #define LUNIX_CHRDEV_MAJOR	60	/* Reserved for local / experimental use */
-#define LUNIX_CHRDEV_BUFSZ      20      /* Buffer size used to hold textual info */
+#define LUNIX_CHRDEV_RECSZ      10      /* Width of a single cooked value in the text stream */
+#define LUNIX_CHRDEV_FAST_SAMPLES 8	/* Samples a lock-free read() claims and copies out at a time */
+
+#include "lunix.h"
 
 /* Compile-time parameters */
 
 #ifdef __KERNEL__ 
 
 #include <linux/fs.h>
+#include <linux/rwsem.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
 
-#include "lunix.h"
-
 /*
  * Private state for an open character device node
  */
@@ -33,13 +35,57 @@ struct lunix_chrdev_state_struct {
 	enum lunix_msr_enum type;
 	struct lunix_sensor_struct *sensor;
 
-	/* A buffer used to hold cached textual info */
+	/*
+	 * A buffer used to hold cached textual info,
+	 * large enough for a whole history ring of values
+	 */
 	int buf_lim;
-	unsigned char buf_data[LUNIX_CHRDEV_BUFSZ];
-	uint32_t buf_timestamp;
+	int buf_pos;		/* Bytes of it already read */
+	unsigned char *buf_data;
+
+	/*
+	 * Sequence number of the last sample of this measurement
+	 * consumed, compared against the sensor's msr_seq[]. Readers
+	 * sharing the file claim samples by moving it forward with
+	 * cmpxchg. hist_snap is a scratch copy of the samples claimed,
+	 * for reads that go through the buffer above.
+	 */
+	atomic64_t hist_seq;
+	struct lunix_msr_sample_struct *hist_snap;
+
+	/*
+	 * The consumer group this file has joined, if any.
+	 * Its shared cursor is used instead of hist_seq.
+	 */
+	struct lunix_msr_group_struct *group;
+
+	/*
+	 * The filter set on the measurement, if flags != 0,
+	 * and where consuming samples has got to against it
+	 * [under the semaphore]. A filtered file sleeps on filter.wq.
+	 */
+	struct lunix_msr_filter_struct filter;
+	struct lunix_filter_ref filter_ref;
 
 	struct semaphore lock;
 
+	/*
+	 * Set once the file has been polled [under cfg_lock for
+	 * reading], after which it must keep its wait queue: poll()
+	 * and epoll registrations are never moved to a new one.
+	 */
+	int polled;
+
+	/*
+	 * Held for reading by the lock-free read path, which
+	 * takes no semaphore, and for writing [with the semaphore
+	 * held too] while the group or the filter changes, so
+	 * that no claim runs against a cursor or filter that is
+	 * going away. Readers sharing the file do not exclude
+	 * each other.
+	 */
+	struct rw_semaphore cfg_lock;
+
 	/*
 	 * Fixme: Any mode settings? e.g. blocking vs. non-blocking
 	 */
@@ -51,6 +97,7 @@ struct lunix_chrdev_state_struct {
  */
 int lunix_chrdev_init(void);
 void lunix_chrdev_destroy(void);
+void lunix_chrdev_sensor_added(void);
 
 #endif	/* __KERNEL__ */
 
@@ -64,7 +111,82 @@ void lunix_chrdev_destroy(void);
 #define CHRDEV_MODE_RAW 0
 #define CHRDEV_MODE_COOKED 1
 
-#define LUNIX_IOC_MAXNR			0	
+/*
+ * Join consumer group <arg> [1 .. LUNIX_MSR_GROUPS] of the measurement,
+ * or leave the current one with arg = 0. Each sample is delivered
+ * to only one of the open files in a group. Fails with EBUSY once the
+ * file has been handed to poll() or epoll, which stay on the wait queue
+ * they found, while a group has a queue of its own.
+ */
+#define LUNIX_IOC_GROUP		_IOW(LUNIX_IOC_MAGIC, 2, int)
+
+/*
+ * Fetch up to count of the oldest unread samples of the measurement
+ * into the array of struct lunix_record at records, consuming them
+ * like read() does. On return, count is the number of records filled.
+ * Blocks until there is at least one, unless the file is O_NONBLOCK,
+ * in which case it fails with EAGAIN.
+ */
+struct lunix_samples {
+	uint64_t records;	/* User pointer to struct lunix_record[count] */
+	uint32_t count;
+	uint32_t __pad;
+};
+#define LUNIX_IOC_GET_SAMPLES	_IOWR(LUNIX_IOC_MAGIC, 3, struct lunix_samples)
+
+/*
+ * Fill in the struct lunix_aggr of the measurement, over a window of
+ * the last window_ms milliseconds [0 for the longest one available,
+ * see the lunix_aggr_window module parameter]. Does not consume
+ * anything, and never blocks.
+ */
+#define LUNIX_IOC_GET_AGGR	_IOWR(LUNIX_IOC_MAGIC, 4, struct lunix_aggr)
+
+/*
+ * Only deliver [and only wake up readers and pollers for] the samples
+ * of the measurement whose cooked value, in thousandths, qualifies:
+ *   LUNIX_FILTER_CROSS     lies on another side of low or high than
+ *                          the sample before it did
+ *   LUNIX_FILTER_DELTA     is at least delta away from the last
+ *                          value delivered
+ * With both flags, either will do, and with neither, every sample
+ * qualifies. Of those that do, deliver only:
+ *   LUNIX_FILTER_EVERY     every Nth one
+ *   LUNIX_FILTER_INTERVAL  the first one at least interval_ms after
+ *                          the last sample delivered, by receive time
+ * flags = 0 removes the filter. Setting a filter discards any unread
+ * samples, and the latest one is what the first new ones are compared
+ * against. A filtered file has a wait queue of its own, so the filter
+ * must be set or removed before the file is handed to poll() or epoll;
+ * afterwards this fails with EBUSY. Files in a consumer group cannot
+ * be filtered.
+ */
+struct lunix_filter {
+	uint32_t flags;
+	int32_t low;
+	int32_t high;
+	int32_t delta;
+	uint32_t interval_ms;
+	uint32_t every;
+};
+#define LUNIX_IOC_SET_FILTER	_IOW(LUNIX_IOC_MAGIC, 5, struct lunix_filter)
+
+/*
+ * mmap() offsets of a measurement node:
+ *   0                       the page holding its measurement record,
+ *                           at the offset LUNIX_IOC_MSR_OFFSET returns
+ *   LUNIX_MSR_TABLE_OFFSET  with the packed layout only, the table of
+ *     + n * page size       the records of the first lunix_msr_packed_ids
+ *                           sensors [see LUNIX_MSR_SLOTS in lunix.h]
+ *                           from its nth page on, so that a single
+ *                           mapping covers a block of them, or all
+ * Without the packed layout, or past those sensors, every record
+ * starts its own page and the offset is always 0.
+ */
+#define LUNIX_MSR_TABLE_OFFSET	0x40000000UL
+#define LUNIX_IOC_MSR_OFFSET	_IOR(LUNIX_IOC_MAGIC, 6, uint32_t)
+
+#define LUNIX_IOC_MAXNR			6
 
 #endif	/* _LUNIX_H */
 
@@ -0,0 +1,214 @@
+/*
+ * lunix-layout-bench.c
+ *
+ * False-sharing microbenchmark for the layout of the Lunix:TNG
+ * sensor table [struct lunix_sensor_struct in lunix.h].
+ *
+ * Every sensor gets an updater thread, which takes its lock and
+ * bumps its sequence numbers the way lunix_sensor_update() does,
+ * and a reader thread, which polls the sequence numbers and writes
+ * to the wait queue words the way sleeping and waking readers do.
+ * No two threads ever touch the same sensor in the same role, so
+ * whatever they slow each other down by is false sharing.
+ *
+ * The sensor table is laid out twice: packed, as an array of plain
+ * structures, like it used to be, and with each sensor, and the
+ * writer-hot and reader-hot fields within it, on cache lines of
+ * their own, like it is now. Both are run for the same time and
+ * their update and read rates are compared.
+ *
+ * Threads are pinned round-robin to the online CPUs, so that the
+ * updater and the reader of a sensor, and neighbouring sensors, run
+ * on different ones. False sharing needs threads running at the same
+ * time on different cores: with a single CPU online the two layouts
+ * can only come out alike, within noise, and the bench says so.
+ *
+ * So far it has only been run on a single CPU. Whether the current
+ * layout actually beats the packed one remains to be measured on a
+ * multi-core host; until then, the layout is a design choice only.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "lunix.h"
+
+#define LAYOUT_CACHELINE	64
+#define LAYOUT_MAX_SENSORS	64
+
+/*
+ * The two layouts, reduced to the fields the update path
+ * and readers write to
+ */
+struct packed_sensor {
+	uint32_t lock;
+	uint64_t msr_seq[N_LUNIX_MSR];
+	uint32_t wq[N_LUNIX_MSR];
+};
+
+struct aligned_sensor {
+	struct {
+		uint32_t lock;
+		uint64_t msr_seq[N_LUNIX_MSR];
+	} w __attribute__((aligned(LAYOUT_CACHELINE)));
+	struct {
+		uint32_t wq[N_LUNIX_MSR];
+	} r __attribute__((aligned(LAYOUT_CACHELINE)));
+} __attribute__((aligned(LAYOUT_CACHELINE)));
+
+/*
+ * What a thread works on, and what it counts, on a line of its own
+ * so that the benchmark does not add false sharing of its own
+ */
+struct worker {
+	uint32_t *lock;
+	uint64_t *msr_seq;
+	uint32_t *wq;
+	unsigned long ops;
+	pthread_t thread;
+} __attribute__((aligned(LAYOUT_CACHELINE)));
+
+static volatile int stop;
+static long ncpus;
+
+static void *updater(void *arg)
+{
+	struct worker *w = arg;
+	unsigned long ops = 0;
+	int type = 0;
+
+	while (!stop) {
+		while (__atomic_exchange_n(w->lock, 1, __ATOMIC_ACQUIRE))
+			;
+		__atomic_store_n(&w->msr_seq[type], w->msr_seq[type] + 1, __ATOMIC_RELAXED);
+		__atomic_store_n(w->lock, 0, __ATOMIC_RELEASE);
+		type = (type + 1) % N_LUNIX_MSR;
+		ops++;
+	}
+	w->ops = ops;
+	return NULL;
+}
+
+static void *reader(void *arg)
+{
+	struct worker *w = arg;
+	unsigned long ops = 0;
+	uint64_t seen = 0, seq;
+
+	while (!stop) {
+		seq = __atomic_load_n(&w->msr_seq[TEMP], __ATOMIC_ACQUIRE);
+		if (seq != seen) {
+			/* Like a reader waking up and queueing up again */
+			__atomic_fetch_add(&w->wq[TEMP], 1, __ATOMIC_RELAXED);
+			seen = seq;
+		}
+		ops++;
+	}
+	w->ops = ops;
+	return NULL;
+}
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Run an updater and a reader on each of the n sensors of a layout
+ * for secs seconds, and return their rates in ops per second.
+ */
+static int run(struct worker *workers, int n, double secs, double *updates, double *reads)
+{
+	double start, wall;
+	unsigned long u = 0, r = 0;
+	pthread_attr_t attr;
+	cpu_set_t cpus;
+	int i;
+
+	stop = 0;
+	start = now_sec();
+	for (i = 0; i < 2 * n; i++) {
+		/* Updater i on CPU 2i, its reader on CPU 2i + 1, wrapping around */
+		pthread_attr_init(&attr);
+		CPU_ZERO(&cpus);
+		CPU_SET((i < n ? 2 * i : 2 * (i - n) + 1) % ncpus, &cpus);
+		pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+		if (pthread_create(&workers[i].thread, &attr, (i < n) ? updater : reader, &workers[i])) {
+			perror("pthread_create");
+			return -1;
+		}
+		pthread_attr_destroy(&attr);
+	}
+	usleep((useconds_t)(secs * 1e6));
+	stop = 1;
+	for (i = 0; i < 2 * n; i++)
+		pthread_join(workers[i].thread, NULL);
+	wall = now_sec() - start;
+
+	for (i = 0; i < n; i++) {
+		u += workers[i].ops;
+		r += workers[n + i].ops;
+	}
+	*updates = u / wall;
+	*reads = r / wall;
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	static struct packed_sensor packed[LAYOUT_MAX_SENSORS] __attribute__((aligned(LAYOUT_CACHELINE)));
+	static struct aligned_sensor aligned[LAYOUT_MAX_SENSORS];
+	static struct worker workers[2 * LAYOUT_MAX_SENSORS];
+	double secs, pu, pr, au, ar;
+	int i, n;
+
+	secs = (argc > 1) ? atof(argv[1]) : 2.0;
+	n = (argc > 2) ? atoi(argv[2]) : 4;
+	if (secs <= 0 || n < 1 || n > LAYOUT_MAX_SENSORS) {
+		fprintf(stderr, "Usage: %s [SECONDS] [NSENSORS <= %d]\n", argv[0], LAYOUT_MAX_SENSORS);
+		return 1;
+	}
+
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpus < 1)
+		ncpus = 1;
+
+	/* Workers i and n + i update and read sensor i */
+	for (i = 0; i < n; i++) {
+		workers[i].lock = workers[n + i].lock = &packed[i].lock;
+		workers[i].msr_seq = workers[n + i].msr_seq = packed[i].msr_seq;
+		workers[i].wq = workers[n + i].wq = packed[i].wq;
+	}
+	if (run(workers, n, secs, &pu, &pr) < 0)
+		return 1;
+
+	for (i = 0; i < n; i++) {
+		workers[i].lock = workers[n + i].lock = &aligned[i].w.lock;
+		workers[i].msr_seq = workers[n + i].msr_seq = aligned[i].w.msr_seq;
+		workers[i].wq = workers[n + i].wq = aligned[i].r.wq;
+	}
+	if (run(workers, n, secs, &au, &ar) < 0)
+		return 1;
+
+	printf("%d sensors, %zu-byte packed and %zu-byte aligned sensors, %ld CPUs\n",
+		n, sizeof(struct packed_sensor), sizeof(struct aligned_sensor), ncpus);
+	printf("packed:  %8.2f M updates/s, %8.2f M reader polls/s\n", pu / 1e6, pr / 1e6);
+	printf("aligned: %8.2f M updates/s, %8.2f M reader polls/s\n", au / 1e6, ar / 1e6);
+	printf("aligned/packed: updates x%.2f, reader polls x%.2f\n", au / pu, ar / pr);
+	if (ncpus < 2)
+		printf("A single CPU is online, so no two threads ever ran at once: "
+			"false sharing cannot show, and the ratios are noise\n");
+
+	return 0;
+}
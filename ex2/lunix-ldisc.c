@@ -9,6 +9,9 @@
 
 #include <linux/tty.h>
 #include <linux/slab.h>
+#include <linux/kfifo.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
 #include <linux/init.h>
 #include <linux/serio.h>
 #include <linux/kernel.h>
@@ -22,28 +25,155 @@
 #include "lunix-protocol.h"
 
 /*
- * This line discipline can only be associated
- * with a single TTY at any time.
+ * This line discipline can be associated with up to
+ * lunix_ldisc_max TTYs [base stations] at any time.
+ * Each one gets its own protocol state machine, and
+ * they all feed the same sensor table.
  */
+int lunix_ldisc_max = LUNIX_LDISC_MAX;
+int lunix_ldisc_stage = LUNIX_LDISC_STAGE;
+int lunix_ldisc_deferred = 0;
 static atomic_t lunix_disc_available;
 
+/*
+ * In deferred mode, staged bytes are parsed by a work item
+ * on this workqueue instead of in the TTY receive path.
+ */
+static struct workqueue_struct *lunix_ldisc_wq;
+
+/*
+ * Per-TTY state, hanging off tty->disc_data.
+ *
+ * Received bytes are first copied into the staging fifo,
+ * then fed to the protocol state machine in batches of up
+ * to LUNIX_LDISC_BATCH bytes. The TTY is throttled while
+ * the fifo is close to full.
+ *
+ * In deferred mode the TTY layer is the only producer and
+ * the work item the only consumer of the fifo, so it needs
+ * no locking. Sensors updated by the work item are put on
+ * the touched list and woken up once the fifo is empty.
+ */
+struct lunix_ldisc_struct {
+	struct tty_struct *tty;
+	struct lunix_protocol_state_struct proto;
+
+	DECLARE_KFIFO_PTR(stage, unsigned char);
+	struct mutex room_lock;		/* Protects throttled */
+	int throttled;			/* We have throttled the TTY */
+
+	int deferred;
+	struct work_struct work;
+	struct list_head touched;
+
+	unsigned char batch[LUNIX_LDISC_BATCH];
+};
+
+/*
+ * Throttle the TTY while the free space in the staging fifo
+ * is less than a quarter of it, until it is half empty again.
+ * Called from process context, by the TTY layer or the work item.
+ *
+ * Throttling only asks the driver to hold off the sender; it goes
+ * through the exported tty_throttle()/tty_unthrottle(), as the
+ * _safe variants and the buffer work are private to the TTY core.
+ * Nothing re-kicks that buffer work once the fifo drains, so
+ * lunix_ldisc_receive_buf2() never leaves bytes behind: when the
+ * fifo is full it drains it itself, see there.
+ */
+static void lunix_ldisc_check_room(struct lunix_ldisc_struct *ld)
+{
+	struct tty_struct *tty = ld->tty;
+	unsigned int room;
+
+	mutex_lock(&ld->room_lock);
+	room = kfifo_avail(&ld->stage);
+
+	if (!ld->throttled && room < kfifo_size(&ld->stage) / 4) {
+		tty_throttle(tty);
+		ld->throttled = 1;
+		debug("TTY %s throttled, %u bytes of room left\n", tty->name, room);
+	} else if (ld->throttled && room >= kfifo_size(&ld->stage) / 2) {
+		tty_unthrottle(tty);
+		ld->throttled = 0;
+		debug("TTY %s unthrottled\n", tty->name);
+	}
+	mutex_unlock(&ld->room_lock);
+}
+
+/*
+ * Drain the staging fifo into the protocol state machine,
+ * one batch at a time.
+ */
+static void lunix_ldisc_process(struct lunix_ldisc_struct *ld)
+{
+	unsigned int n;
+
+	while ((n = kfifo_out(&ld->stage, ld->batch, sizeof(ld->batch))) > 0)
+		lunix_protocol_received_buf(&ld->proto, ld->batch, n);
+}
+
+/*
+ * The deferred mode work item: drain the fifo, then wake up
+ * the readers of every sensor it updated, once per sensor
+ * no matter how many packets it got, and those of
+ * /dev/lunix-all once for the whole batch.
+ */
+static void lunix_ldisc_work(struct work_struct *work)
+{
+	struct lunix_ldisc_struct *ld = container_of(work, struct lunix_ldisc_struct, work);
+
+	lunix_ldisc_process(ld);
+	lunix_sensor_wake_touched(&ld->touched);
+
+	lunix_ldisc_check_room(ld);
+}
+
 /*
  * This function runs when the userspace helper
  * sets the Lunix:TNG line discipline on a TTY.
  */
 static int lunix_ldisc_open(struct tty_struct *tty)
 {
+	struct lunix_ldisc_struct *ld;
+	int ret;
+
 	if (!capable(CAP_SYS_ADMIN))
 		return -EPERM;
 	
-	/* Can only be associated with a single TTY */
+	/* Can only be associated with a limited number of TTYs */
 	if ( !atomic_add_unless(&lunix_disc_available, -1, 0))
 		return -EBUSY;
 
-	tty->receive_room = 65536; /* No flow control, FIXME */
+	ret = -ENOMEM;
+	ld = kzalloc(sizeof(*ld), GFP_KERNEL);
+	if (!ld)
+		goto out;
+	if (kfifo_alloc(&ld->stage, lunix_ldisc_stage, GFP_KERNEL))
+		goto out_with_ld;
+	ld->tty = tty;
+	mutex_init(&ld->room_lock);
+	lunix_protocol_init(&ld->proto);
+
+	ld->deferred = lunix_ldisc_deferred;
+	if (ld->deferred) {
+		INIT_LIST_HEAD(&ld->touched);
+		INIT_WORK(&ld->work, lunix_ldisc_work);
+		ld->proto.touched = &ld->touched;
+	}
+	tty->disc_data = ld;
 
-	debug("lunix ldisc associated with TTY %s\n", tty->name);
+	lunix_ldisc_check_room(ld);
+
+	debug("lunix ldisc associated with TTY %s, %u bytes of staging, %s processing\n",
+		tty->name, kfifo_size(&ld->stage), ld->deferred ? "deferred" : "inline");
 	return 0;
+
+out_with_ld:
+	kfree(ld);
+out:
+	atomic_inc(&lunix_disc_available);
+	return ret;
 }
 
 /*
@@ -53,6 +183,22 @@ static int lunix_ldisc_open(struct tty_struct *tty)
 
 static void lunix_ldisc_close(struct tty_struct *tty)
 {
+	struct lunix_ldisc_struct *ld = tty->disc_data;
+	struct lunix_protocol_stats *stats = &ld->proto.stats;
+
+	printk(KERN_INFO "lunix ldisc on TTY %s: %llu bytes, %llu packets, %llu CRC errors, "
+		"%llu resyncs skipping %llu bytes\n",
+		tty->name, stats->bytes, stats->packets, stats->crc_errors,
+		stats->resyncs, stats->resync_bytes);
+
+	if (ld->deferred)
+		flush_work(&ld->work);
+	if (ld->throttled)
+		tty_unthrottle(tty);
+	tty->disc_data = NULL;
+	kfifo_free(&ld->stage);
+	kfree(ld);
+
 	atomic_inc(&lunix_disc_available);
 	/* FIXME */
 	/* Shouldn't we wake up all sleepers in all sensors here? */
@@ -60,13 +206,20 @@ static void lunix_ldisc_close(struct tty_struct *tty)
 }
 
 /*
- * lunix_ldisc_receive_buf() is called by the TTY layer when data have been
+ * lunix_ldisc_receive_buf2() is called by the TTY layer when data have been
  * received by the low level TTY driver and are ready for us. This function
  * will not be re-entered while running.
+ *
+ * It always takes all count bytes. Bytes left in the TTY buffer would
+ * only be offered to us again on the next push from the driver, which
+ * may never come, so when the staging fifo fills up the caller waits
+ * for it to be drained, by the work item in deferred mode, and goes on.
  */
-static void lunix_ldisc_receive_buf(struct tty_struct *tty,
+static int lunix_ldisc_receive_buf2(struct tty_struct *tty,
 	const unsigned char *cp, char *fp, int count)
 {
+	struct lunix_ldisc_struct *ld = tty->disc_data;
+	int n = 0;
 #if LUNIX_DEBUG
 	int i;
 
@@ -79,12 +232,39 @@ static void lunix_ldisc_receive_buf(struct tty_struct *tty,
 #endif
 	//printk(KERN_INFO "lunix_ldisc_receive_buf called\n");
 
-	/*
-	 * Pass incoming characters to protocol processing code,
-	 * which handle any necessary sensor updates.
-	 */
-	lunix_protocol_received_buf(&lunix_protocol_state, cp, count);
+	while (n < count) {
+		n += kfifo_in(&ld->stage, cp + n, count - n);
+
+		/*
+		 * Pass staged characters to protocol processing code,
+		 * which handle any necessary sensor updates, or leave
+		 * them to the work item in deferred mode.
+		 */
+		if (ld->deferred) {
+			queue_work(lunix_ldisc_wq, &ld->work);
+			if (n < count)
+				flush_work(&ld->work);
+		} else
+			lunix_ldisc_process(ld);
+	}
+	lunix_ldisc_check_room(ld);
+
 	//debug("passed incoming bytes to state machine, leaving\n");
+	return n;
+}
+
+/*
+ * Called by the TTY layer to discard any input not yet
+ * processed, e.g. on tcflush(TCIFLUSH) or a hangup.
+ */
+static void lunix_ldisc_flush_buffer(struct tty_struct *tty)
+{
+	struct lunix_ldisc_struct *ld = tty->disc_data;
+
+	if (ld->deferred)
+		flush_work(&ld->work);
+	kfifo_reset(&ld->stage);
+	lunix_ldisc_check_room(ld);
 }
 
 /*
@@ -107,6 +287,26 @@ static ssize_t lunix_ldisc_write(struct tty_struct * tty, struct file * file,
 	return -EIO;
 }
 
+/*
+ * Report the protocol counters to userspace,
+ * leave anything else to the TTY layer.
+ */
+static int lunix_ldisc_ioctl(struct tty_struct *tty, struct file *file,
+	unsigned int cmd, unsigned long arg)
+{
+	struct lunix_ldisc_struct *ld;
+
+	switch (cmd) {
+	case LUNIX_LDISC_IOC_STATS:
+		ld = tty->disc_data;
+		if (copy_to_user((void __user *)arg, &ld->proto.stats, sizeof(ld->proto.stats)))
+			return -EFAULT;
+		return 0;
+	default:
+		return tty_mode_ioctl(tty, file, cmd, arg);
+	}
+}
+
 /*
  * The line discipline structure.
  * Initialization and release functions.
@@ -119,7 +319,9 @@ static struct tty_ldisc_ops lunix_ldisc_ops = {
 	.close =	lunix_ldisc_close,
 	.read =		lunix_ldisc_read,
 	.write =	lunix_ldisc_write,
-	.receive_buf =	lunix_ldisc_receive_buf
+	.ioctl =	lunix_ldisc_ioctl,
+	.flush_buffer =	lunix_ldisc_flush_buffer,
+	.receive_buf2 =	lunix_ldisc_receive_buf2
 };
 
 int lunix_ldisc_init(void)
@@ -127,10 +329,19 @@ int lunix_ldisc_init(void)
 	int ret;
 
 	debug("initializing lunix ldisc\n");
-	atomic_set(&lunix_disc_available, 1);
+	atomic_set(&lunix_disc_available, lunix_ldisc_max);
+	if (lunix_ldisc_stage < LUNIX_LDISC_BATCH)
+		lunix_ldisc_stage = LUNIX_LDISC_BATCH;
+
+	lunix_ldisc_wq = alloc_workqueue("lunix_ldisc", WQ_HIGHPRI, 0);
+	if (!lunix_ldisc_wq)
+		return -ENOMEM;
+
 	ret = tty_register_ldisc(N_LUNIX_LDISC, &lunix_ldisc_ops);
-	if (ret)
+	if (ret) {
 		printk(KERN_ERR "%s: Error registering line discipline, ret = %d.\n", __FILE__, ret);
+		destroy_workqueue(lunix_ldisc_wq);
+	}
 	
 	debug("leaving with ret = %d\n", ret);
 	return ret;
@@ -140,6 +351,7 @@ void lunix_ldisc_destroy(void)
 {
 	debug("unregistering lunix ldisc\n");
 	tty_unregister_ldisc(N_LUNIX_LDISC);
+	destroy_workqueue(lunix_ldisc_wq);
 	debug("lunix ldisc unregistered\n");
 }
 
@@ -15,6 +15,28 @@
 
 #ifdef __KERNEL__ 
 
+/*
+ * The default maximum number of TTYs the
+ * line discipline can be attached to at once
+ */
+#define LUNIX_LDISC_MAX		8
+extern int lunix_ldisc_max;
+
+/*
+ * The default size of the per-TTY staging fifo, in bytes
+ * [rounded down to a power of two], and the largest number
+ * of bytes handed to the protocol state machine in one go
+ */
+#define LUNIX_LDISC_STAGE	4096
+#define LUNIX_LDISC_BATCH	512
+extern int lunix_ldisc_stage;
+
+/*
+ * Parse received bytes from a workqueue instead
+ * of the TTY receive path [lunix_ldisc_deferred=1]
+ */
+extern int lunix_ldisc_deferred;
+
 /*
  * Function prototypes
  */
@@ -23,5 +45,14 @@ void lunix_ldisc_destroy(void);
 
 #endif	/* __KERNEL__ */
 
+#include <linux/ioctl.h>
+
+/*
+ * ioctl commands understood by a TTY with the Lunix:TNG
+ * line discipline set [see lunix-attach.c]
+ */
+#define LUNIX_LDISC_IOC_MAGIC		'L'
+#define LUNIX_LDISC_IOC_STATS		_IOR(LUNIX_LDISC_IOC_MAGIC, 1, struct lunix_protocol_stats)
+
 #endif	/* _LUNIX_H */
 
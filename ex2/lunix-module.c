@@ -7,11 +7,13 @@
  *
  */
 
+#include <linux/log2.h>
 #include <linux/slab.h>
 #include <linux/module.h>
 #include <linux/kernel.h>
 
 #include "lunix.h"
+#include "lunix-all.h"
 #include "lunix-chrdev.h"
 #include "lunix-ldisc.h"
 #include "lunix-protocol.h"
@@ -20,8 +22,12 @@
  * Global state for Lunix:TNG sensors
  */
 int lunix_sensor_cnt = LUNIX_SENSOR_CNT;
-struct lunix_sensor_struct *lunix_sensors;
-struct lunix_protocol_state_struct lunix_protocol_state;
+int lunix_sensor_hist = LUNIX_SENSOR_HIST;
+int lunix_aggr_window = LUNIX_AGGR_WINDOW;
+int lunix_msr_packed;
+int lunix_msr_packed_ids = LUNIX_MSR_PACKED_IDS;
+void *lunix_msr_table;
+unsigned long lunix_msr_table_size;
 
 /*
  * Module init and cleanup functions
@@ -30,30 +36,33 @@ struct lunix_protocol_state_struct lunix_protocol_state;
 int __init lunix_module_init(void)
 {
 	int ret;
-	int si_done;
 
-	printk(KERN_INFO "Initializing the Lunix:TNG module [max %d sensors]\n",
-		lunix_sensor_cnt);
+	/* Node ids are 16-bit, and id 0 is never used */
+	lunix_sensor_cnt = clamp(lunix_sensor_cnt, 1, LUNIX_SENSOR_CNT);
+	lunix_sensor_hist = clamp(lunix_sensor_hist, 1, LUNIX_SENSOR_HIST_MAX);
+	lunix_sensor_hist = roundup_pow_of_two(lunix_sensor_hist);
+	if (lunix_aggr_window < 1)
+		lunix_aggr_window = 1;
+	/* The aggregate device rings are mapped to userspace in whole pages */
+	lunix_all_ring = clamp_t(int, lunix_all_ring, PAGE_SIZE / sizeof(struct lunix_record), LUNIX_ALL_RING_MAX);
+	lunix_all_ring = roundup_pow_of_two(lunix_all_ring);
 
-	ret = -ENOMEM;
-	lunix_sensors = kzalloc(sizeof(*lunix_sensors) * lunix_sensor_cnt, GFP_KERNEL);
-	if (!lunix_sensors) {
-		printk(KERN_ERR "Failed to allocate memory for Lunix sensors\n");
+	printk(KERN_INFO "Initializing the Lunix:TNG module [node ids up to %d, %d samples of history]\n",
+		lunix_sensor_cnt, lunix_sensor_hist);
+
+	lunix_protocol_crc_init();
+
+	if ((ret = lunix_msr_table_init()) < 0) {
+		printk(KERN_ERR "Failed to allocate the packed measurement table\n");
 		goto out;
 	}
-	lunix_protocol_init(&lunix_protocol_state);
 
 	/*
-	 * Initialize all sensors. On exit, si_done is the index of the last
-	 * successfully initialized sensor.
+	 * The sensors themselves are allocated as they are heard from
 	 */
-	for (si_done = -1; si_done < lunix_sensor_cnt - 1; si_done++) {
-		debug("initializing sensor %d\n", si_done + 1);
-		ret = lunix_sensor_init(&lunix_sensors[si_done + 1]);
-		debug("initialized sensor %d, ret = %d\n", si_done + 1, ret);
-		if (ret < 0) {
-			goto out_with_sensors;
-		}
+	if ((ret = lunix_sensors_init()) < 0) {
+		printk(KERN_ERR "Failed to allocate memory for Lunix sensors\n");
+		goto out_with_msr_table;
 	}
 
 	/*
@@ -68,21 +77,33 @@ int __init lunix_module_init(void)
 	if ((ret = lunix_chrdev_init()) < 0)
 		goto out_with_ldisc;
 
+	/*
+	 * Initialize the aggregate device
+	 */
+	if ((ret = lunix_all_init()) < 0)
+		goto out_with_chrdev;
+
 	return 0;
 
 	/*
 	 * Something's gone wrong, undo everything
 	 * we've done up to this point
 	 */
+out_with_chrdev:
+	debug("at out_with_chrdev\n");
+	lunix_chrdev_destroy();
+
 out_with_ldisc:
 	debug("at out_with_ldisc\n");
 	lunix_ldisc_destroy();
 
 out_with_sensors:
 	debug("at out_with_sensors\n");
-	for (; si_done >= 0; si_done--)
-		lunix_sensor_destroy(&lunix_sensors[si_done]);
-	kfree(lunix_sensors);
+	lunix_sensors_destroy();
+
+out_with_msr_table:
+	debug("at out_with_msr_table\n");
+	lunix_msr_table_destroy();
 
 out:
 	debug("at out\n");
@@ -91,16 +112,14 @@ out:
 
 void __exit lunix_module_cleanup(void)
 {
-	int si_done;
-	
-	debug("entering, destroying chrdev and ldisc\n");
+	debug("entering, destroying aggregate device, chrdev and ldisc\n");
+	lunix_all_destroy();
 	lunix_chrdev_destroy();
 	lunix_ldisc_destroy();
 	
-	debug("destroying sensor buffers\n");
-	for (si_done = lunix_sensor_cnt - 1; si_done >= 0; si_done--)
-		lunix_sensor_destroy(&lunix_sensors[si_done]);
-	kfree(lunix_sensors);
+	debug("destroying sensors\n");
+	lunix_sensors_destroy();
+	lunix_msr_table_destroy();
 
 	printk(KERN_INFO "Lunix:TNG module unloaded successfully\n");
 }
@@ -114,7 +133,29 @@ MODULE_AUTHOR("Vangelis Koukis");
 MODULE_LICENSE("GPL");
 
 module_param(lunix_sensor_cnt, int, 0);
-MODULE_PARM_DESC(lunix_sensor_cnt, "Maximum number of sensors to support");
+MODULE_PARM_DESC(lunix_sensor_cnt, "Highest node id accepted, at most 65535 (sensors are allocated on their first packet)");
+module_param(lunix_sensor_hist, int, 0);
+MODULE_PARM_DESC(lunix_sensor_hist, "Number of samples kept per measurement, at most 1024 (rounded up to a power of two)");
+module_param(lunix_msr_packed, int, 0);
+MODULE_PARM_DESC(lunix_msr_packed, "Pack the measurement records of sensors into shared pages instead of a page each (default 0)");
+module_param(lunix_msr_packed_ids, int, 0);
+MODULE_PARM_DESC(lunix_msr_packed_ids, "Number of sensors, from the first, whose records are packed, 256 bytes each allocated up front");
+module_param(lunix_aggr_window, int, 0);
+MODULE_PARM_DESC(lunix_aggr_window, "Longest window of the per-measurement aggregates, in seconds");
+module_param(lunix_all_ring, int, 0);
+MODULE_PARM_DESC(lunix_all_ring, "Number of records buffered per open /dev/lunix-all, at most 65536 (rounded up to a power of two, at least a page)");
+module_param(lunix_all_max, int, 0);
+MODULE_PARM_DESC(lunix_all_max, "Maximum number of concurrent opens of /dev/lunix-all");
+module_param(lunix_ldisc_max, int, 0);
+MODULE_PARM_DESC(lunix_ldisc_max, "Maximum number of TTYs to receive sensor data from");
+module_param(lunix_ldisc_stage, int, 0);
+MODULE_PARM_DESC(lunix_ldisc_stage, "Bytes of received data staged per TTY (rounded down to a power of two)");
+module_param(lunix_ldisc_deferred, int, 0644);
+MODULE_PARM_DESC(lunix_ldisc_deferred, "Parse received data from a workqueue, waking readers once per batch (default 0, applies to newly attached TTYs)");
+module_param(lunix_protocol_fastpath, int, 0644);
+MODULE_PARM_DESC(lunix_protocol_fastpath, "Parse whole packets in the tty buffer in one go (default 1)");
+module_param(lunix_protocol_check_crc, int, 0644);
+MODULE_PARM_DESC(lunix_protocol_check_crc, "Drop packets with a bad CRC (default 1)");
 
 module_init(lunix_module_init);
 module_exit(lunix_module_cleanup);
@@ -0,0 +1,153 @@
+/*
+ * lunix-msr.h
+ *
+ * Header-only userspace API for reading Lunix:TNG
+ * measurement pages through mmap(), without any syscalls.
+ *
+ * lunix_sensor_update() bumps the seq field of a page to an odd
+ * value before rewriting it and back to an even value afterwards.
+ * A snapshot is consistent if seq was even and did not change
+ * while the rest of the page was being copied.
+ *
+ * With the packed layout [the lunix_msr_packed module parameter],
+ * records of the first lunix_msr_packed_ids sensors do not start
+ * their own page, and lunix_msr_table_map() maps those of a whole
+ * range of them at once.
+ *
+ */
+
+#ifndef _LUNIX_MSR_H
+#define _LUNIX_MSR_H
+
+#include <stddef.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+
+#include "lunix.h"
+#include "lunix-chrdev.h"
+
+/*
+ * A consistent copy of a measurement page
+ */
+struct lunix_msr_snapshot {
+	uint32_t seq;
+	uint32_t last_update;
+	uint64_t update_seq;
+	uint64_t update_ns;
+	uint32_t value;
+};
+
+/*
+ * Map the measurement page of an open /dev/lunix<NO>-<TYPE> node.
+ * Returns NULL on failure.
+ */
+static inline const struct lunix_msr_data_struct *lunix_msr_map(int fd)
+{
+	uint32_t off;
+	char *p;
+
+	/* Drivers without the packed layout always start records at 0 */
+	if (ioctl(fd, LUNIX_IOC_MSR_OFFSET, &off) < 0)
+		off = 0;
+
+	p = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, fd, 0);
+	return (p == MAP_FAILED) ? NULL : (const struct lunix_msr_data_struct *)(p + off);
+}
+
+static inline void lunix_msr_unmap(const struct lunix_msr_data_struct *msr)
+{
+	long pgsz = sysconf(_SC_PAGESIZE);
+
+	munmap((void *)((uintptr_t)msr & ~(uintptr_t)(pgsz - 1)), pgsz);
+}
+
+/*
+ * A mapping of the packed records of sensors first .. first + n - 1
+ */
+struct lunix_msr_table {
+	char *base;
+	size_t len;
+	off_t start;		/* Table offset base maps */
+};
+
+/*
+ * Map the packed records of n sensors starting with /dev/lunix<first>-*,
+ * through any open measurement node fd. Fails if the driver does not
+ * use the packed layout, or it does not pack as many sensors.
+ */
+static inline int lunix_msr_table_map(int fd, int first, int n, struct lunix_msr_table *t)
+{
+	long pgsz = sysconf(_SC_PAGESIZE);
+	off_t end;
+	void *p;
+
+	t->start = (off_t)first * LUNIX_MSR_SLOTS * LUNIX_MSR_SLOTSZ / pgsz * pgsz;
+	end = (off_t)(first + n) * LUNIX_MSR_SLOTS * LUNIX_MSR_SLOTSZ;
+	t->len = (end - t->start + pgsz - 1) / pgsz * pgsz;
+
+	p = mmap(NULL, t->len, PROT_READ, MAP_SHARED, fd, LUNIX_MSR_TABLE_OFFSET + t->start);
+	if (p == MAP_FAILED)
+		return -1;
+	t->base = p;
+	return 0;
+}
+
+static inline void lunix_msr_table_unmap(struct lunix_msr_table *t)
+{
+	munmap(t->base, t->len);
+}
+
+/*
+ * The record of measurement type of /dev/lunix<sensor>-*,
+ * which must lie within the mapped range
+ */
+static inline const struct lunix_msr_data_struct *lunix_msr_table_record(
+	const struct lunix_msr_table *t, int sensor, int type)
+{
+	return (const struct lunix_msr_data_struct *)(t->base - t->start +
+		((off_t)sensor * LUNIX_MSR_SLOTS + type) * LUNIX_MSR_SLOTSZ);
+}
+
+static inline uint32_t lunix_msr_seq(const struct lunix_msr_data_struct *msr)
+{
+	return __atomic_load_n(&msr->seq, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Cheap check for whether the page has changed since
+ * a snapshot with sequence number seq was taken.
+ */
+static inline int lunix_msr_changed(const struct lunix_msr_data_struct *msr, uint32_t seq)
+{
+	return lunix_msr_seq(msr) != seq;
+}
+
+/*
+ * Take a consistent snapshot of a measurement page,
+ * retrying for as long as an update is in progress.
+ */
+static inline void lunix_msr_snapshot(const struct lunix_msr_data_struct *msr,
+	struct lunix_msr_snapshot *snap)
+{
+	uint32_t seq;
+
+	for (;;) {
+		seq = lunix_msr_seq(msr);
+		if (seq & 1)
+			continue;
+
+		snap->last_update = __atomic_load_n(&msr->last_update, __ATOMIC_RELAXED);
+		snap->update_seq = __atomic_load_n(&msr->update_seq, __ATOMIC_RELAXED);
+		snap->update_ns = __atomic_load_n(&msr->update_ns, __ATOMIC_RELAXED);
+		snap->value = __atomic_load_n(&msr->values[0], __ATOMIC_RELAXED);
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&msr->seq, __ATOMIC_RELAXED) == seq)
+			break;
+	}
+	snap->seq = seq;
+}
+
+#endif	/* _LUNIX_MSR_H */
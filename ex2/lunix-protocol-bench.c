@@ -0,0 +1,168 @@
+/*
+ * lunix-protocol-bench.c
+ *
+ * Userspace throughput benchmark for the XMesh protocol
+ * parser of Lunix:TNG [lunix-protocol.c], built against
+ * the stubs in uspace/.
+ *
+ * A stream of synthetic sensor packets is fed to the parser
+ * in tty-sized chunks, first through the byte-at-a-time state
+ * machine and then with the fast path enabled. Both runs must
+ * decode exactly the same measurements. Optionally, every Nth
+ * packet is corrupted after its CRC has been computed, and must
+ * be dropped by the parser, and every Mth packet is preceded
+ * by line noise, which the parser must resync past.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lunix.h"
+#include "lunix-protocol.h"
+#include "lunix-xmesh.h"
+
+#define BENCH_PACKETS		4096
+#define BENCH_SENSORS		16
+#define BENCH_NOISE_LEN		5
+
+/*
+ * Stand-ins for the sensor side of the driver:
+ * count packets and checksum their contents.
+ */
+int lunix_sensor_cnt = BENCH_SENSORS;
+
+static struct lunix_sensor_struct bench_sensors[BENCH_SENSORS];
+static unsigned long updates;
+static unsigned long long update_sum;
+
+struct lunix_sensor_struct *lunix_sensor_get_or_create(unsigned int id, gfp_t gfp)
+{
+	return &bench_sensors[id];
+}
+
+void lunix_sensor_touch(struct lunix_sensor_struct *s, struct list_head *touched)
+{
+}
+
+void lunix_sensor_update(struct lunix_sensor_struct *s,
+	uint16_t batt, uint16_t temp, uint16_t light)
+{
+	updates++;
+	update_sum = update_sum * 31 + (s - bench_sensors) + batt + temp * 3 + light * 7;
+}
+
+void __lunix_sensor_update(struct lunix_sensor_struct *s,
+	uint16_t batt, uint16_t temp, uint16_t light)
+{
+	lunix_sensor_update(s, batt, temp, light);
+}
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Feed the stream to a fresh parser rounds times, in chunks of
+ * chunk bytes. Returns the throughput in bytes per second.
+ */
+static double run(const unsigned char *stream, int len, int chunk, int rounds,
+	struct lunix_protocol_stats *stats)
+{
+	struct lunix_protocol_state_struct state;
+	double start, end;
+	int r, i;
+
+	lunix_protocol_init(&state);
+	updates = 0;
+	update_sum = 0;
+
+	start = now_sec();
+	for (r = 0; r < rounds; r++)
+		for (i = 0; i < len; i += chunk)
+			lunix_protocol_received_buf(&state, stream + i, min(chunk, len - i));
+	end = now_sec();
+
+	*stats = state.stats;
+	return (double)len * rounds / (end - start);
+}
+
+int main(int argc, char *argv[])
+{
+	struct lunix_protocol_stats slow_stats, fast_stats;
+	unsigned char *stream;
+	unsigned long slow_updates, expected;
+	unsigned long long slow_sum;
+	double slow, fast;
+	int i, j, len, chunk, rounds, corrupt, ncorrupt, noise, nnoise;
+
+	chunk = (argc > 1) ? atoi(argv[1]) : 256;
+	rounds = (argc > 2) ? atoi(argv[2]) : 200;
+	corrupt = (argc > 3) ? atoi(argv[3]) : 0;
+	noise = (argc > 4) ? atoi(argv[4]) : 0;
+	if (chunk < 1 || rounds < 1 || corrupt < 0 || noise < 0) {
+		fprintf(stderr, "Usage: %s [CHUNK_BYTES] [ROUNDS] [CORRUPT_EVERY_NTH] [NOISE_EVERY_MTH]\n",
+			argv[0]);
+		return 1;
+	}
+
+	lunix_protocol_crc_init();
+	stream = malloc(BENCH_PACKETS * (LUNIX_XMESH_WIRE_MAX + BENCH_NOISE_LEN));
+	if (!stream) {
+		perror("malloc");
+		return 1;
+	}
+
+	srand(1);
+	len = 0;
+	ncorrupt = 0;
+	nnoise = 0;
+	for (i = 0; i < BENCH_PACKETS; i++) {
+		/* Noise never contains a start byte, so that no packet is lost to it */
+		if (noise && i % noise == noise - 1) {
+			for (j = 0; j < BENCH_NOISE_LEN; j++)
+				stream[len++] = 0x01 + rand() % 0x7C;
+			nnoise++;
+		}
+		len += lunix_xmesh_packet(stream + len, 1 + i % BENCH_SENSORS,
+			rand() & 0x3FF, rand() & 0x3FF, rand(),
+			corrupt && (i % corrupt == 0));
+		ncorrupt += corrupt && (i % corrupt == 0);
+	}
+	expected = (unsigned long)(BENCH_PACKETS - ncorrupt) * rounds;
+
+	lunix_protocol_fastpath = 0;
+	slow = run(stream, len, chunk, rounds, &slow_stats);
+	slow_updates = updates;
+	slow_sum = update_sum;
+
+	lunix_protocol_fastpath = 1;
+	fast = run(stream, len, chunk, rounds, &fast_stats);
+
+	printf("%d-byte stream, %d-byte chunks, %d rounds\n", len, chunk, rounds);
+	printf("state machine: %8.1f MB/s, %lu packets, %llu CRC errors, %llu resyncs skipping %llu bytes\n",
+		slow / 1e6, slow_updates, (unsigned long long)slow_stats.crc_errors,
+		(unsigned long long)slow_stats.resyncs, (unsigned long long)slow_stats.resync_bytes);
+	printf("fast path:     %8.1f MB/s, %lu packets, %llu CRC errors, %llu resyncs skipping %llu bytes\n",
+		fast / 1e6, updates, (unsigned long long)fast_stats.crc_errors,
+		(unsigned long long)fast_stats.resyncs, (unsigned long long)fast_stats.resync_bytes);
+
+	if (updates != slow_updates || update_sum != slow_sum || updates != expected ||
+	    fast_stats.crc_errors != (unsigned long long)ncorrupt * rounds ||
+	    slow_stats.crc_errors != fast_stats.crc_errors ||
+	    fast_stats.resyncs != (unsigned long long)nnoise * rounds ||
+	    fast_stats.resync_bytes != (unsigned long long)nnoise * rounds * BENCH_NOISE_LEN ||
+	    slow_stats.resyncs != fast_stats.resyncs ||
+	    slow_stats.resync_bytes != fast_stats.resync_bytes) {
+		fprintf(stderr, "The two parsers disagree!\n");
+		return 1;
+	}
+
+	return 0;
+}
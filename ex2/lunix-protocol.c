@@ -15,11 +15,68 @@
  */
 
 #include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/bitops.h>
 #include <asm/byteorder.h>
+#include <asm/unaligned.h>
 
 #include "lunix.h"
 #include "lunix-protocol.h"
 
+/*
+ * Whether to try parsing whole packets in one go before
+ * falling back to the byte-at-a-time state machine
+ */
+int lunix_protocol_fastpath = 1;
+
+/*
+ * Whether to drop packets whose CRC does not match their contents
+ */
+int lunix_protocol_check_crc = 1;
+
+/*
+ * Lookup tables for the CRC-16 [CCITT polynomial 0x1021, initial
+ * value 0, no reflection] appended by the motes to every packet.
+ * lunix_crc_table[k][x] is the CRC of byte x followed by k zero
+ * bytes, which lets lunix_crc16() fold in four bytes per step
+ * ["slice-by-4"].
+ */
+#define LUNIX_CRC_POLY	0x1021
+#define LUNIX_CRC_SLICES	4
+
+static uint16_t lunix_crc_table[LUNIX_CRC_SLICES][256];
+
+void lunix_protocol_crc_init(void)
+{
+	uint16_t crc;
+	int i, j, k;
+
+	for (i = 0; i < 256; i++) {
+		crc = i << 8;
+		for (j = 0; j < 8; j++)
+			crc = (crc & 0x8000) ? (crc << 1) ^ LUNIX_CRC_POLY : crc << 1;
+		lunix_crc_table[0][i] = crc;
+	}
+	for (k = 1; k < LUNIX_CRC_SLICES; k++)
+		for (i = 0; i < 256; i++) {
+			crc = lunix_crc_table[k - 1][i];
+			lunix_crc_table[k][i] = (crc << 8) ^ lunix_crc_table[0][crc >> 8];
+		}
+}
+
+static uint16_t lunix_crc16(uint16_t crc, const unsigned char *p, int len)
+{
+	for (; len >= 4; p += 4, len -= 4)
+		crc = lunix_crc_table[3][(crc >> 8) ^ p[0]] ^
+		      lunix_crc_table[2][(crc & 0xFF) ^ p[1]] ^
+		      lunix_crc_table[1][p[2]] ^
+		      lunix_crc_table[0][p[3]];
+	for (; len > 0; p++, len--)
+		crc = (crc << 8) ^ lunix_crc_table[0][(crc >> 8) ^ *p];
+
+	return crc;
+}
+
 /*
  * Returns an unsigned 16-bit integer in native byte-order from 
  * two bytes in an XMesh packet, which is always little-endian
@@ -32,6 +89,18 @@ static uint16_t uint16_from_packet(unsigned char *p)
 	return le16_to_cpu(le);
 }
 
+/*
+ * The CRC covers everything from the packet type up to the end
+ * of the payload, and follows it in little-endian byte order.
+ */
+static int lunix_protocol_crc_ok(struct lunix_protocol_state_struct *state)
+{
+	int payload_length = state->packet[6];
+
+	return lunix_crc16(0, &state->packet[1], 6 + payload_length) ==
+		uint16_from_packet(&state->packet[7 + payload_length]);
+}
+
 /*
  * Will display the contents of an incoming XMesh packet
  * that have been received so far
@@ -55,8 +124,9 @@ static inline void lunix_protocol_show_packet(struct lunix_protocol_state_struct
  * types of packets. In future releases check packets with packet[4]
  * equal to 0x03, 0xFD for extending this function.
  */
-static void lunix_protocol_update_sensors(struct lunix_protocol_state_struct *state, struct lunix_sensor_struct *lunix_sensors)
+static void lunix_protocol_update_sensors(struct lunix_protocol_state_struct *state)
 {
+	struct lunix_sensor_struct *s;
 	uint16_t batt;
 	uint16_t temp;
 	uint16_t light;
@@ -75,11 +145,25 @@ static void lunix_protocol_update_sensors(struct lunix_protocol_state_struct *st
 		debug ("I have the following raw data from nodeid = %d: { batt, temp, light } = { 0x%04x, 0x%04x, 0x%04x }\n",
 			nodeid, batt, temp, light);
 
-		if (nodeid > 0 && nodeid <= lunix_sensor_cnt)
-			lunix_sensor_update(&lunix_sensors[nodeid - 1], batt, temp, light);
-		else
+		if (nodeid == 0 || nodeid > lunix_sensor_cnt) {
 			printk(KERN_WARNING "Node id %d is out of bounds [maximum %d sensors]\n",
 				nodeid, lunix_sensor_cnt);
+			return;
+		}
+
+		/* The first packet from a node brings its sensor into existence */
+		s = lunix_sensor_get_or_create(nodeid - 1, GFP_ATOMIC);
+		if (!s) {
+			printk_ratelimited(KERN_WARNING "Out of memory for the sensor of node id %d\n", nodeid);
+			return;
+		}
+
+		/* Leave waking up the readers to the end of the batch */
+		if (state->touched) {
+			__lunix_sensor_update(s, batt, temp, light);
+			lunix_sensor_touch(s, state->touched);
+		} else
+			lunix_sensor_update(s, batt, temp, light);
 	}
 }
 
@@ -110,11 +194,26 @@ static inline void set_state(struct lunix_protocol_state_struct *statep, int sta
 	//lunix_protocol_show_packet(statep);
 }
 
+/*
+ * Give up on the packet being received and scan forward for the
+ * next start byte. The bytes of the aborted packet count as skipped.
+ */
+static void lunix_protocol_resync(struct lunix_protocol_state_struct *state)
+{
+	state->stats.resyncs++;
+	state->stats.resync_bytes += state->pos;
+	state->pos = 0;
+	state->next_is_special = 0;
+	set_state(state, SEEKING_RESYNC, 0, 0);
+}
+
 /*
  * Initialization of protocol state machine
  */
 void lunix_protocol_init(struct lunix_protocol_state_struct *state)
 {
+	memset(&state->stats, 0, sizeof(state->stats));
+	state->touched = NULL;
 	state->pos = 0;
 	state->next_is_special = 0;
 	set_state(state, SEEKING_START_BYTE, 1, 0);
@@ -151,9 +250,8 @@ static int lunix_protocol_parse_state(struct lunix_protocol_state_struct *state,
 		/* Prevent buffer overflows */
 		if (state->pos == MAX_PACKET_LEN) {
 			printk(KERN_ERR "WARNING: state->pos == %d, MAX_PACKET_LEN is %d,"
-				"packet buffer would overflow!\n", state->pos, MAX_PACKET_LEN);
-			printk(KERN_ERR "How will I ever resync with the input stream?\n");
-			state->pos = 0;
+				"packet buffer would overflow, resyncing\n", state->pos, MAX_PACKET_LEN);
+			lunix_protocol_resync(state);
 			return -1;
 		}
 
@@ -205,26 +303,189 @@ static int lunix_protocol_parse_state(struct lunix_protocol_state_struct *state,
 }
 
 /*
- * This function gets called for incoming data
- * to update the protocol state machine.
+ * Called when the state machine or the fast path has
+ * assembled a complete packet in state->packet.
+ */
+static void lunix_protocol_packet_done(struct lunix_protocol_state_struct *state)
+{
+	state->stats.packets++;
+
+	if (lunix_protocol_check_crc && !lunix_protocol_crc_ok(state)) {
+		/* Garbage must not reach the sensors, nor wake up their readers */
+		state->stats.crc_errors++;
+		debug("Dropping XMesh packet with bad CRC\n");
+		lunix_protocol_show_packet(state);
+	} else {
+		debug("A complete XMesh packet has been received, updating sensors\n");
+		lunix_protocol_update_sensors(state);
+	}
+
+	state->pos = 0;
+	state->next_is_special = 0;
+	set_state(state, SEEKING_START_BYTE, 1, 0);
+}
+
+/*
+ * Word-at-a-time search for the special 0x7E and 0x7D bytes:
+ * a byte of v is zero iff the matching bit of has_zero_byte(v)
+ * is set [see "Bit Twiddling Hacks"].
  */
+#define ONE_BYTES	(~0UL / 0xFF)
+#define HIGH_BITS	(ONE_BYTES * 0x80)
 
-int lunix_protocol_received_buf(struct lunix_protocol_state_struct *state,
-	const unsigned char *buf, int length)
+static inline unsigned long has_zero_byte(unsigned long v)
 {
+	return (v - ONE_BYTES) & ~v & HIGH_BITS;
+}
+
+/*
+ * Returns the offset of the first special byte in p[0 .. n),
+ * or n if there is none.
+ */
+static int lunix_protocol_find_special(const unsigned char *p, int n)
+{
+	unsigned long v;
 	int i;
-	int payload_length;
 
-	i = 0;
+	for (i = 0; i + (int)sizeof(v) <= n; i += sizeof(v)) {
+		v = get_unaligned((const unsigned long *)(p + i));
+		if (has_zero_byte(v ^ (ONE_BYTES * 0x7E)) | has_zero_byte(v ^ (ONE_BYTES * 0x7D)))
+			break;
+	}
+	for (; i < n; i++)
+		if (p[i] == 0x7E || p[i] == 0x7D)
+			return i;
+
+	return n;
+}
+
+/*
+ * Un-escape up to want bytes from buf[*i .. length) into dst, copying
+ * runs of ordinary bytes in bulk. Escapes are handled exactly like
+ * lunix_protocol_parse_state() does with use_specials set. Returns the
+ * number of bytes produced; less than want means the buffer ran out.
+ */
+static int lunix_protocol_unescape(unsigned char *dst, int want,
+	const unsigned char *buf, int length, int *i)
+{
+	int got, run;
+
+	got = 0;
+	while (got < want && *i < length) {
+		run = lunix_protocol_find_special(buf + *i, min(length - *i, want - got));
+		memcpy(dst + got, buf + *i, run);
+		got += run;
+		*i += run;
+
+		if (got == want || *i == length)
+			break;
+
+		/* A special byte, the next one completes the escape */
+		if (*i + 1 == length)
+			break;
+		dst[got++] = (buf[*i] == 0x7D) ? buf[*i + 1] ^ 0x20 : buf[*i + 1];
+		*i += 2;
+	}
+
+	return got;
+}
+
+/*
+ * Fast path for the common case of a whole packet sitting in buf,
+ * starting at buf[*i]. Only valid at a packet boundary. On success
+ * the packet is in state->packet, *i points past it and 1 is returned.
+ * Otherwise nothing is consumed and the caller should fall back to
+ * the state machine, which can carry a packet across buffers.
+ */
+static int lunix_protocol_fast_packet(struct lunix_protocol_state_struct *state,
+	const unsigned char *buf, int length, int *i)
+{
+	unsigned char *pkt = state->packet;
+	int j, payload_length;
+
+	/* Start byte, packet type, header, CRC and end byte at the very least */
+	j = *i;
+	if (length - j < 10)
+		return 0;
+
+	/*
+	 * Start byte and packet type are never escaped. Anything unexpected
+	 * is left to the state machine, which knows how to resync.
+	 */
+	if (buf[j] != 0x7E || buf[j + 1] == 0x7E)
+		return 0;
+	pkt[0] = buf[j++];
+	pkt[1] = buf[j++];
+
+	/* Destination address, AM type, AM group, payload length */
+	if (lunix_protocol_unescape(pkt + 2, 5, buf, length, &j) != 5)
+		return 0;
+
+	/* Payload and CRC */
+	payload_length = pkt[6];
+	if (payload_length > MAX_PAYLOAD_LEN)
+		return 0;
+	if (lunix_protocol_unescape(pkt + 7, payload_length + 2, buf, length, &j) != payload_length + 2)
+		return 0;
+
+	/* End byte */
+	if (j == length || buf[j] != 0x7E)
+		return 0;
+	pkt[7 + payload_length + 2] = buf[j++];
+
+	state->pos = 7 + payload_length + 3;
+	*i = j;
+	return 1;
+}
+
+/*
+ * Feed buf[*i .. length) through the state machine, one state at a time,
+ * until either the buffer runs out or a complete packet is received.
+ */
+static void lunix_protocol_parse_states(struct lunix_protocol_state_struct *state,
+	const unsigned char *buf, int length, int *ip)
+{
+	int i;
+	int payload_length;
+	const unsigned char *p;
+
+	i = *ip;
+
+	/*
+	 * Out of sync: skip everything up to the next 0x7E,
+	 * which is taken to be a start byte.
+	 */
+	if (state->state == SEEKING_RESYNC) {
+		p = memchr(buf + i, 0x7E, length - i);
+		state->stats.resync_bytes += (p ? p - buf : length) - i;
+		i = p ? p - buf : length;
+		if (p)
+			set_state(state, SEEKING_START_BYTE, 1, 0);
+	}
 
 	if (state->state == SEEKING_START_BYTE) 
-		if (lunix_protocol_parse_state(state, buf, length, &i, 0) == 1)
-			set_state(state, SEEKING_PACKET_TYPE, 1, 0);
+		if (lunix_protocol_parse_state(state, buf, length, &i, 0) == 1) {
+			if (state->packet[0] == 0x7E)
+				set_state(state, SEEKING_PACKET_TYPE, 1, 0);
+			else
+				lunix_protocol_resync(state);
+		}
 
 
 	if (state->state == SEEKING_PACKET_TYPE) 
-		if (lunix_protocol_parse_state(state, buf, length, &i, 0) == 1)
-			set_state(state, SEEKING_DESTINATION_ADDRESS, 2, 0);
+		if (lunix_protocol_parse_state(state, buf, length, &i, 0) == 1) {
+			if (state->packet[1] != 0x7E) {
+				set_state(state, SEEKING_DESTINATION_ADDRESS, 2, 0);
+			} else {
+				/*
+				 * The 0x7E we started on ended the previous packet,
+				 * this one is the real start byte.
+				 */
+				state->stats.resync_bytes++;
+				state->pos = 1;
+				set_state(state, SEEKING_PACKET_TYPE, 1, 0);
+			}
+		}
 
 	if (state->state == SEEKING_DESTINATION_ADDRESS) 
 		if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1)
@@ -241,7 +502,10 @@ int lunix_protocol_received_buf(struct lunix_protocol_state_struct *state,
 	if (state->state == SEEKING_PAYLOAD_LENGTH) 
 		if (lunix_protocol_parse_state(state, buf, length, &i, 1) == 1) {
 			payload_length = state->packet[state->pos - 1];
-			set_state(state, SEEKING_PAYLOAD, payload_length, 0);
+			if (payload_length <= MAX_PAYLOAD_LEN)
+				set_state(state, SEEKING_PAYLOAD, payload_length, 0);
+			else
+				lunix_protocol_resync(state);
 		}
 
 	if (state->state == SEEKING_PAYLOAD) 
@@ -254,14 +518,45 @@ int lunix_protocol_received_buf(struct lunix_protocol_state_struct *state,
 
 	if (state->state == SEEKING_END_BYTE) 
 		if (lunix_protocol_parse_state(state, buf, length, &i, 0) == 1) {
-			debug("A complete XMesh packet has been received, updating sensors\n");
+			if (state->packet[state->pos - 1] == 0x7E)
+				lunix_protocol_packet_done(state);
+			else
+				lunix_protocol_resync(state);
+		}
 
-			lunix_protocol_update_sensors(state, lunix_sensors);
-			state->pos = 0;
-			state->next_is_special = 0;
-			set_state(state, SEEKING_START_BYTE, 1, 0);
+	*ip = i;
+}
+
+/*
+ * This function gets called for incoming data
+ * to update the protocol state machine.
+ */
+
+int lunix_protocol_received_buf(struct lunix_protocol_state_struct *state,
+	const unsigned char *buf, int length)
+{
+	int i, prev;
+
+	state->stats.bytes += length;
+
+	i = 0;
+	while (i < length) {
+		/*
+		 * Whole packets are taken in one go, the state machine
+		 * only deals with packets straddling buffer boundaries.
+		 */
+		if (lunix_protocol_fastpath && state->state == SEEKING_START_BYTE &&
+		    lunix_protocol_fast_packet(state, buf, length, &i)) {
+			lunix_protocol_packet_done(state);
+			continue;
 		}
 
+		prev = i;
+		lunix_protocol_parse_states(state, buf, length, &i);
+		if (i == prev)
+			break;
+	}
+
 	//debug("leaving\n");
 
 	return 0;
@@ -13,18 +13,31 @@
 #ifndef _LUNIX_PROTOCOL_H
 #define _LUNIX_PROTOCOL_H
 
-#ifdef __KERNEL__ 
-
 /*
  * Application/Protocol specific constants
  */
 #define MAX_PACKET_LEN 300
+#define MAX_PAYLOAD_LEN (MAX_PACKET_LEN - 10)
 #define PACKET_SIGNATURE_OFFSET 4
 #define NODE_OFFSET 9
 #define VREF_OFFSET 18
 #define TEMPERATURE_OFFSET 20
 #define LIGHT_OFFSET 22
 
+/*
+ * Counters kept by the protocol state machine,
+ * see LUNIX_LDISC_IOC_STATS in lunix-ldisc.h
+ */
+struct lunix_protocol_stats {
+	uint64_t bytes;			/* Bytes received from the TTY */
+	uint64_t packets;		/* Complete packets framed */
+	uint64_t crc_errors;		/* Packets dropped for a bad CRC */
+	uint64_t resyncs;		/* Times the framing was lost */
+	uint64_t resync_bytes;		/* Bytes skipped while resyncing */
+};
+
+#ifdef __KERNEL__ 
+
 /*
  * States of the Lunix protocol state machine
  */
@@ -37,6 +50,7 @@
 #define SEEKING_PAYLOAD                7
 #define SEEKING_CRC                    8
 #define SEEKING_END_BYTE               9
+#define SEEKING_RESYNC                10
 
 /*
  * Current state of the Lunix protocol state machine
@@ -51,11 +65,23 @@ struct lunix_protocol_state_struct
 	unsigned char next_is_special;  /* The next character to be received is a special character */
 	unsigned char payload_length;   /* The length of the payload of the received packet */
 	unsigned char packet[MAX_PACKET_LEN]; /* The XMesh packet being received */
+
+	/*
+	 * If set, sensors are updated without waking their readers
+	 * and put on this list instead [see lunix_sensor_touch()]
+	 */
+	struct list_head *touched;
+
+	struct lunix_protocol_stats stats;
 };
 
+extern int lunix_protocol_fastpath;
+extern int lunix_protocol_check_crc;
+
 /*
  * Function prototypes
  */
+void lunix_protocol_crc_init(void);
 void lunix_protocol_init(struct lunix_protocol_state_struct *);
 int lunix_protocol_received_buf(struct lunix_protocol_state_struct *, const unsigned char *buf, int count);
 
@@ -0,0 +1,98 @@
+/*
+ * lunix-relay.c
+ *
+ * Forward the stream of a Lunix:TNG node [/dev/lunix<NO>-<TYPE>]
+ * to a TCP endpoint, splicing it through a pipe so that the data
+ * never has to be copied to and from userspace.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "lunix.h"
+
+/* Connect to host:port, returning the socket or -1. */
+static int tcp_connect(const char *host, const char *port)
+{
+	struct addrinfo hints, *res, *ai;
+	int sd, err;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if ((err = getaddrinfo(host, port, &hints, &res)) != 0) {
+		fprintf(stderr, "%s:%s: %s\n", host, port, gai_strerror(err));
+		return -1;
+	}
+
+	sd = -1;
+	for (ai = res; ai; ai = ai->ai_next) {
+		if ((sd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0)
+			continue;
+		if (connect(sd, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+		close(sd);
+		sd = -1;
+	}
+	freeaddrinfo(res);
+
+	if (sd < 0)
+		fprintf(stderr, "%s:%s: could not connect\n", host, port);
+	return sd;
+}
+
+int main(int argc, char *argv[])
+{
+	ssize_t in, out;
+	int fd, sd, pfd[2];
+
+	if (argc != 4) {
+		fprintf(stderr, "Usage: %s /dev/lunix<NO>-<TYPE> HOST PORT\n", argv[0]);
+		return 1;
+	}
+
+	if ((fd = open(argv[1], O_RDONLY)) < 0) {
+		perror(argv[1]);
+		return 1;
+	}
+	if ((sd = tcp_connect(argv[2], argv[3])) < 0)
+		return 1;
+	if (pipe(pfd) < 0) {
+		perror("pipe");
+		return 1;
+	}
+
+	/*
+	 * Each splice() from the node blocks until there is
+	 * new data, just like read(), and moves all of it.
+	 */
+	for (;;) {
+		if ((in = splice(fd, NULL, pfd[1], NULL, 65536, SPLICE_F_MOVE)) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("splice from node");
+			return 1;
+		}
+		while (in > 0) {
+			if ((out = splice(pfd[0], NULL, sd, NULL, in, SPLICE_F_MOVE | SPLICE_F_MORE)) < 0) {
+				if (errno == EINTR)
+					continue;
+				perror("splice to socket");
+				return 1;
+			}
+			in -= out;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,86 @@
+/*
+ * lunix-ring.h
+ *
+ * Header-only userspace API for consuming the record ring of
+ * an open /dev/lunix-all in place, through mmap(), without
+ * copying records out with read().
+ *
+ * See struct lunix_all_ring_header in lunix-all.h for the
+ * rules both sides follow.
+ *
+ */
+
+#ifndef _LUNIX_RING_H
+#define _LUNIX_RING_H
+
+#include <stddef.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+
+#include "lunix-all.h"
+
+struct lunix_ring {
+	struct lunix_all_ring_header *hdr;
+	const struct lunix_record *recs;
+	size_t len;			/* Length of the whole mapping */
+};
+
+/*
+ * Map the ring of an open /dev/lunix-all. Its size is only known
+ * from its header, so map the header page alone first to find out.
+ * Returns 0, or -1 on failure with errno set.
+ */
+static inline int lunix_ring_map(int fd, struct lunix_ring *ring)
+{
+	struct lunix_all_ring_header *hdr;
+	long pgsz = sysconf(_SC_PAGESIZE);
+	uint32_t size;
+	void *p;
+
+	hdr = mmap(NULL, pgsz, PROT_READ, MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED)
+		return -1;
+	size = hdr->size;
+	munmap(hdr, pgsz);
+
+	ring->len = pgsz + (size_t)size * sizeof(struct lunix_record);
+	p = mmap(NULL, ring->len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED)
+		return -1;
+
+	ring->hdr = p;
+	ring->recs = (const struct lunix_record *)((char *)p + pgsz);
+	return 0;
+}
+
+static inline void lunix_ring_unmap(struct lunix_ring *ring)
+{
+	munmap(ring->hdr, ring->len);
+}
+
+/* Position just past the newest record */
+static inline uint64_t lunix_ring_head(const struct lunix_ring *ring)
+{
+	return __atomic_load_n(&ring->hdr->head, __ATOMIC_ACQUIRE);
+}
+
+/* Position of the oldest unread record */
+static inline uint64_t lunix_ring_tail(const struct lunix_ring *ring)
+{
+	return ring->hdr->tail;
+}
+
+static inline const struct lunix_record *lunix_ring_record(const struct lunix_ring *ring,
+	uint64_t pos)
+{
+	return &ring->recs[pos & (ring->hdr->size - 1)];
+}
+
+/* Hand the slots of all records before tail back to the driver */
+static inline void lunix_ring_consume(struct lunix_ring *ring, uint64_t tail)
+{
+	__atomic_store_n(&ring->hdr->tail, tail, __ATOMIC_RELEASE);
+}
+
+#endif	/* _LUNIX_RING_H */
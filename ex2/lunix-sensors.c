@@ -11,6 +11,8 @@
 #include <linux/mm.h>
 #include <linux/fs.h>
 #include <linux/init.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
 #include <linux/list.h>
 #include <linux/poll.h>
 #include <linux/slab.h>
@@ -24,36 +26,187 @@
 #include <linux/spinlock.h>
 
 #include "lunix.h"
+#include "lunix-all.h"
+#include "lunix-chrdev.h"
+#include "lunix-lookup.h"
+
+/*
+ * The sensor table, and the cache sensors are allocated from,
+ * which keeps each of them on cache lines of its own
+ */
+DEFINE_XARRAY(lunix_sensor_xa);
+static struct kmem_cache *lunix_sensor_cache;
+
+/*
+ * Allocate the packed table of measurement records, if asked to,
+ * before any sensor is initialized. It is vmalloc_user()'d, so that
+ * any part of it can be mapped to userspace, and zeroed. It only
+ * covers the first lunix_msr_packed_ids sensors, as it is allocated
+ * up front for ids that may never be heard from.
+ */
+int lunix_msr_table_init(void)
+{
+	BUILD_BUG_ON(offsetof(struct lunix_msr_data_struct, values) + sizeof(uint32_t) > LUNIX_MSR_SLOTSZ);
+	BUILD_BUG_ON(LUNIX_MSR_SLOTS < N_LUNIX_MSR);
+
+	lunix_msr_packed_ids = clamp(lunix_msr_packed_ids, 0, lunix_sensor_cnt);
+	if (!lunix_msr_packed || !lunix_msr_packed_ids)
+		return 0;
+
+	lunix_msr_table_size = PAGE_ALIGN((unsigned long)lunix_msr_packed_ids * LUNIX_MSR_SLOTS * LUNIX_MSR_SLOTSZ);
+	lunix_msr_table = vmalloc_user(lunix_msr_table_size);
+	if (!lunix_msr_table)
+		return -ENOMEM;
+
+	debug("packed measurement records in %lu pages\n", lunix_msr_table_size >> PAGE_SHIFT);
+	return 0;
+}
+
+void lunix_msr_table_destroy(void)
+{
+	vfree(lunix_msr_table);
+	lunix_msr_table = NULL;
+}
+
+int lunix_sensors_init(void)
+{
+	lunix_sensor_cache = KMEM_CACHE(lunix_sensor_struct, SLAB_HWCACHE_ALIGN);
+	if (!lunix_sensor_cache)
+		return -ENOMEM;
+
+	return 0;
+}
+
+/*
+ * Destroy every sensor that was ever allocated,
+ * once nothing can look them up any more
+ */
+void lunix_sensors_destroy(void)
+{
+	struct lunix_sensor_struct *s;
+	unsigned long id;
+
+	xa_for_each(&lunix_sensor_xa, id, s) {
+		lunix_sensor_destroy(s);
+		kmem_cache_free(lunix_sensor_cache, s);
+	}
+	xa_destroy(&lunix_sensor_xa);
+	kmem_cache_destroy(lunix_sensor_cache);
+}
+
+/*
+ * Look up a sensor, NULL if it has not been allocated [yet]
+ */
+struct lunix_sensor_struct *lunix_sensor_get(unsigned int id)
+{
+	return xa_load(&lunix_sensor_xa, id);
+}
+
+/*
+ * Look up a sensor, allocating it on the first packet from its node.
+ * Only the protocol does this; opening a device node never does
+ * [see lunix_sensor_get()]. Returns NULL if id is out of range or
+ * memory is short.
+ */
+struct lunix_sensor_struct *lunix_sensor_get_or_create(unsigned int id, gfp_t gfp)
+{
+	struct lunix_sensor_struct *s, *old;
+
+	if (id >= lunix_sensor_cnt)
+		return NULL;
+
+	s = xa_load(&lunix_sensor_xa, id);
+	if (s)
+		return s;
+
+	s = kmem_cache_zalloc(lunix_sensor_cache, gfp);
+	if (!s)
+		return NULL;
+	if (lunix_sensor_init(s, id, gfp) < 0)
+		goto out_with_sensor;
+
+	/* Publish it, unless someone beat us to it */
+	old = xa_cmpxchg(&lunix_sensor_xa, id, NULL, s, gfp);
+	if (xa_is_err(old))
+		goto out_with_sensor;
+	if (old) {
+		lunix_sensor_destroy(s);
+		kmem_cache_free(lunix_sensor_cache, s);
+		return old;
+	}
+
+	debug("allocated sensor %u\n", id);
+	xa_set_mark(&lunix_sensor_xa, id, LUNIX_SENSOR_NEW);
+	lunix_chrdev_sensor_added();
+	return s;
+
+out_with_sensor:
+	lunix_sensor_destroy(s);
+	kmem_cache_free(lunix_sensor_cache, s);
+	return NULL;
+}
 
 /*
  * Initialization and destruction of sensor structures
  */
-int lunix_sensor_init(struct lunix_sensor_struct *s)
+int lunix_sensor_init(struct lunix_sensor_struct *s, unsigned int id, gfp_t gfp)
 {
-	int i;
+	int i, g;
 	int ret;
 	unsigned long p;
 
 	/*
 	 * Initialize structure fields
 	 */
+	s->id = id;
 	spin_lock_init(&s->lock);
-	init_waitqueue_head(&s->wq);
+	for (i = 0; i < N_LUNIX_MSR; i++) {
+		init_waitqueue_head(&s->wq[i]);
+		seqcount_init(&s->hist_seqc[i]);
+		for (g = 0; g < LUNIX_MSR_GROUPS; g++) {
+			atomic64_set(&s->groups[i][g].seq, 0);
+			s->groups[i][g].members = 0;
+			init_waitqueue_head(&s->groups[i][g].wq);
+		}
+		INIT_LIST_HEAD(&s->filters[i]);
+	}
+	s->touched_flags = 0;
+	INIT_LIST_HEAD(&s->touched);
 
 	/*
-	 * Allocate one page per measurement buffer
+	 * Allocate one page per measurement buffer,
+	 * unless they are packed in the shared table
 	 */
-	for (i = 0; i < N_LUNIX_MSR; i++)
+	for (i = 0; i < N_LUNIX_MSR; i++) {
 		s->msr_data[i] = NULL;
+		s->hist[i] = NULL;
+		s->aggr[i] = NULL;
+		s->msr_seq[i] = 0;
+	}
 
 	for (i = 0; i < N_LUNIX_MSR; i++) {
-		p = get_zeroed_page(GFP_KERNEL);
+		if (lunix_msr_in_table(s))
+			p = (unsigned long)lunix_msr_table + lunix_msr_table_offset(s, i);
+		else
+			p = get_zeroed_page(gfp);
 		if (!p) {
 			ret = -ENOMEM;
 			goto out;
 		}
 		s->msr_data[i] = (struct lunix_msr_data_struct *)p;
 		s->msr_data[i]->magic = LUNIX_MSR_MAGIC;
+
+		s->hist[i] = kcalloc(lunix_sensor_hist, sizeof(*s->hist[i]), gfp);
+		if (!s->hist[i]) {
+			ret = -ENOMEM;
+			goto out;
+		}
+
+		s->aggr[i] = kcalloc(LUNIX_AGGR_BUCKETS, sizeof(*s->aggr[i]), gfp);
+		if (!s->aggr[i]) {
+			ret = -ENOMEM;
+			goto out;
+		}
 	}
 
 	ret = 0;
@@ -66,32 +219,353 @@ void lunix_sensor_destroy(struct lunix_sensor_struct *s)
 	int i;
 
 	for (i = 0; i < N_LUNIX_MSR; i++) {
-		if (s->msr_data[i])
+		if (s->msr_data[i] && !lunix_msr_in_table(s))
 			free_page((unsigned long)s->msr_data[i]);
+		kfree(s->hist[i]);
+		kfree(s->aggr[i]);
 	}
 }
 
-void lunix_sensor_update(struct lunix_sensor_struct *s,
+/*
+ * Open and close a write section on a mappable measurement page,
+ * so that lockless userspace readers can spot a concurrent update.
+ * Must be called with the sensor spinlock held.
+ */
+static inline void lunix_msr_write_begin(struct lunix_msr_data_struct *msr)
+{
+	WRITE_ONCE(msr->seq, msr->seq + 1);
+	smp_wmb();
+}
+
+static inline void lunix_msr_write_end(struct lunix_msr_data_struct *msr)
+{
+	smp_wmb();
+	WRITE_ONCE(msr->seq, msr->seq + 1);
+}
+
+/*
+ * Convert a raw value using the lookup tables and format the
+ * result as a fixed-width decimal number, padded with spaces.
+ * This is done once per update, outside the spinlock, so that
+ * readers in cooked mode only have to copy the text out.
+ */
+static void lunix_sensor_cook(struct lunix_msr_sample_struct *smp,
+	int type, uint16_t value, uint64_t timestamp)
+{
+	unsigned char *p;
+	long new_data;
+	int i;
+
+	if (type == BATT)
+		new_data = lunix_lookup_voltage(value);
+	else if (type == TEMP)
+		new_data = lunix_lookup_temperature(value);
+	else
+		new_data = lunix_lookup_light(value);
+
+	smp->timestamp = timestamp;
+	smp->value = value;
+	smp->cooked = new_data;
+
+	memset(smp->text, ' ', LUNIX_MSR_TEXTSZ);
+	p = smp->text;
+	if (new_data < 0) {
+		*p++ = '-';
+		new_data = -new_data;
+	}
+
+	for (i = 0; i < 3; i++) {
+		p[5 - i] = '0' + new_data % 10;
+		new_data /= 10;
+	}
+	p[2] = '.';
+	for (i = 0; i < 2; i++) {
+		p[1 - i] = '0' + new_data % 10;
+		new_data /= 10;
+	}
+}
+
+/*
+ * Append a prepared sample to the history ring of a measurement
+ * and publish it on the mappable page.
+ * Must be called with the sensor spinlock held.
+ */
+static inline void lunix_sensor_hist_push(struct lunix_sensor_struct *s,
+	int type, struct lunix_msr_sample_struct *new)
+{
+	struct lunix_msr_sample_struct *smp;
+	uint64_t seq;
+
+	seq = s->msr_seq[type] + 1;
+	new->seq = seq;
+	smp = &s->hist[type][seq & (lunix_sensor_hist - 1)];
+
+	/* The slot may hold the oldest sample, which a reader may be copying */
+	write_seqcount_begin(&s->hist_seqc[type]);
+	*smp = *new;
+	WRITE_ONCE(s->msr_seq[type], seq);
+	write_seqcount_end(&s->hist_seqc[type]);
+
+	s->msr_data[type]->update_seq = seq;
+	s->msr_data[type]->update_ns = new->timestamp;
+}
+
+/*
+ * Width of an aggregate bucket, and the bucket
+ * a given monotonic time falls in
+ */
+static inline uint64_t lunix_aggr_bucket_ns(void)
+{
+	return div_u64((uint64_t)lunix_aggr_window * NSEC_PER_SEC, LUNIX_AGGR_BUCKETS);
+}
+
+static inline uint64_t lunix_aggr_epoch(uint64_t ns)
+{
+	return div64_u64(ns, lunix_aggr_bucket_ns());
+}
+
+/*
+ * Account a cooked value in the aggregate bucket of epoch.
+ * Must be called with the sensor spinlock held.
+ */
+static inline void lunix_sensor_aggr_add(struct lunix_sensor_struct *s,
+	int type, uint64_t epoch, uint32_t slot, int32_t cooked)
+{
+	struct lunix_aggr_bucket *b = &s->aggr[type][slot];
+
+	if (b->epoch != epoch || !b->count) {
+		/* First sample of a new period, recycle the bucket */
+		b->epoch = epoch;
+		b->sum = 0;
+		b->count = 0;
+		b->min = b->max = cooked;
+	}
+	b->sum += cooked;
+	b->count++;
+	if (cooked < b->min)
+		b->min = cooked;
+	if (cooked > b->max)
+		b->max = cooked;
+}
+
+/*
+ * Aggregate the buckets of a measurement covering the last window_ms
+ * milliseconds [rounded up to whole buckets, at most the whole ring;
+ * zero means the whole ring], the current, partly filled bucket
+ * included.
+ */
+void lunix_sensor_aggr(struct lunix_sensor_struct *s, int type,
+	unsigned int window_ms, struct lunix_aggr *aggr)
+{
+	struct lunix_aggr_bucket *b;
+	uint64_t bucket_ns, epoch, nb;
+	int64_t sum;
+	int i;
+
+	bucket_ns = lunix_aggr_bucket_ns();
+	nb = window_ms ? div64_u64((uint64_t)window_ms * NSEC_PER_MSEC + bucket_ns - 1, bucket_ns) : LUNIX_AGGR_BUCKETS;
+	nb = clamp_t(uint64_t, nb, 1, LUNIX_AGGR_BUCKETS);
+	epoch = lunix_aggr_epoch(ktime_get_ns());
+
+	aggr->count = 0;
+	aggr->min = aggr->max = 0;
+	sum = 0;
+
+	spin_lock(&s->lock);
+	for (i = 0; i < LUNIX_AGGR_BUCKETS; i++) {
+		b = &s->aggr[type][i];
+		if (!b->count || epoch - b->epoch >= nb)
+			continue;
+		if (!aggr->count || b->min < aggr->min)
+			aggr->min = b->min;
+		if (!aggr->count || b->max > aggr->max)
+			aggr->max = b->max;
+		aggr->count += b->count;
+		sum += b->sum;
+	}
+	spin_unlock(&s->lock);
+
+	aggr->window_ms = div_u64(nb * bucket_ns, NSEC_PER_MSEC);
+	aggr->mean = aggr->count ? div_s64(sum, aggr->count) : 0;
+	aggr->__pad = 0;
+}
+
+/*
+ * Test a new sample against the filters set on its measurement,
+ * marking the files it passes for lunix_sensor_wake_msr().
+ * Called with the spinlock held.
+ */
+static void lunix_sensor_filter(struct lunix_sensor_struct *s, int type,
+	const struct lunix_msr_sample_struct *smp)
+{
+	struct lunix_msr_filter_struct *f;
+
+	list_for_each_entry(f, &s->filters[type], list)
+		if (lunix_filter_pass(f, &f->ref, smp)) {
+			WRITE_ONCE(f->pass_seq, smp->seq);
+			f->kick = 1;
+		}
+}
+
+/*
+ * Wake up the readers of a single measurement: every plain reader,
+ * but only one sleeper from each consumer group that has members,
+ * and filtered readers only if a sample passed their filter.
+ */
+static void lunix_sensor_wake_msr(struct lunix_sensor_struct *s, int type)
+{
+	struct lunix_msr_filter_struct *f;
+	int g;
+
+	wake_up_interruptible_all(&s->wq[type]);
+
+	for (g = 0; g < LUNIX_MSR_GROUPS; g++)
+		if (READ_ONCE(s->groups[type][g].members))
+			wake_up_interruptible(&s->groups[type][g].wq);
+
+	if (list_empty(&s->filters[type]))
+		return;
+
+	spin_lock(&s->lock);
+	list_for_each_entry(f, &s->filters[type], list)
+		if (f->kick) {
+			f->kick = 0;
+			wake_up_interruptible_all(&f->wq);
+		}
+	spin_unlock(&s->lock);
+}
+
+/*
+ * Wake up any sleepers who may be waiting on
+ * fresh data from this sensor. The __ variant leaves
+ * the readers of /dev/lunix-all to the caller, so that
+ * a batch of sensors wakes them up only once.
+ */
+void __lunix_sensor_wake(struct lunix_sensor_struct *s)
+{
+	int i;
+
+	for (i = 0; i < N_LUNIX_MSR; i++)
+		lunix_sensor_wake_msr(s, i);
+}
+
+void lunix_sensor_wake(struct lunix_sensor_struct *s)
+{
+	__lunix_sensor_wake(s);
+	lunix_all_wake();
+}
+
+/*
+ * Note that a sensor was updated by a batch and needs waking up,
+ * by putting it on the batch's touched list, unless it already is
+ * on that list or on the one of another TTY: whoever wakes it up
+ * from there clears the bit afterwards, and so sees our update.
+ * The list is only ever walked by the TTY that owns it.
+ */
+void lunix_sensor_touch(struct lunix_sensor_struct *s, struct list_head *touched)
+{
+	/* Order the update before the test, for a failed test_and_set_bit() too */
+	smp_mb__before_atomic();
+	if (!test_and_set_bit(LUNIX_SENSOR_TOUCHED, &s->touched_flags))
+		list_add_tail(&s->touched, touched);
+}
+
+/*
+ * Wake up every sensor on a touched list, emptying it,
+ * and the readers of /dev/lunix-all once for all of them
+ */
+void lunix_sensor_wake_touched(struct list_head *touched)
+{
+	struct lunix_sensor_struct *s, *tmp;
+
+	list_for_each_entry_safe(s, tmp, touched, touched) {
+		list_del_init(&s->touched);
+		/*
+		 * Off the list before the bit is seen clear, and the bit
+		 * clear before looking at the data, pairing with the
+		 * barrier in lunix_sensor_touch()
+		 */
+		smp_mb__before_atomic();
+		clear_bit(LUNIX_SENSOR_TOUCHED, &s->touched_flags);
+		smp_mb__after_atomic();
+		__lunix_sensor_wake(s);
+	}
+	lunix_all_wake();
+}
+
+/*
+ * Store a new set of measurements, without waking anyone up.
+ * Callers updating many sensors at once use this and call
+ * lunix_sensor_wake() once per sensor when done.
+ */
+void __lunix_sensor_update(struct lunix_sensor_struct *s,
 	uint16_t batt, uint16_t temp, uint16_t light)
 {
+	struct lunix_msr_sample_struct smp[N_LUNIX_MSR];
+	uint32_t now, slot;
+	uint64_t now_ns, epoch;
+
+	now = get_seconds();
+	now_ns = ktime_get_ns();
+	epoch = lunix_aggr_epoch(now_ns);
+	div_u64_rem(epoch, LUNIX_AGGR_BUCKETS, &slot);
+
+	lunix_sensor_cook(&smp[BATT], BATT, batt, now_ns);
+	lunix_sensor_cook(&smp[TEMP], TEMP, temp, now_ns);
+	lunix_sensor_cook(&smp[LIGHT], LIGHT, light, now_ns);
+
 	spin_lock(&s->lock);
 	
 	/*
 	 * Update the raw values and the relevant timestamps.
 	 */
+	lunix_msr_write_begin(s->msr_data[BATT]);
+	lunix_msr_write_begin(s->msr_data[TEMP]);
+	lunix_msr_write_begin(s->msr_data[LIGHT]);
+
 	s->msr_data[BATT]->values[0] = batt;
 	s->msr_data[TEMP]->values[0] = temp;
 	s->msr_data[LIGHT]->values[0] = light;
 
 	s->msr_data[BATT]->magic = s->msr_data[TEMP]->magic = s->msr_data[LIGHT]->magic = LUNIX_MSR_MAGIC;
-	s->msr_data[BATT]->last_update = s->msr_data[TEMP]->last_update = s->msr_data[LIGHT]->last_update = get_seconds();
-	
-	spin_unlock(&s->lock);
+	s->msr_data[BATT]->last_update = s->msr_data[TEMP]->last_update = s->msr_data[LIGHT]->last_update = now;
+
+	/*
+	 * Keep every sample in the history rings, so that
+	 * slow readers can catch up on what they missed.
+	 */
+	lunix_sensor_hist_push(s, BATT, &smp[BATT]);
+	lunix_sensor_hist_push(s, TEMP, &smp[TEMP]);
+	lunix_sensor_hist_push(s, LIGHT, &smp[LIGHT]);
+
+	/* And fold them into the windowed aggregates */
+	lunix_sensor_aggr_add(s, BATT, epoch, slot, smp[BATT].cooked);
+	lunix_sensor_aggr_add(s, TEMP, epoch, slot, smp[TEMP].cooked);
+	lunix_sensor_aggr_add(s, LIGHT, epoch, slot, smp[LIGHT].cooked);
+
+	/* Filtered readers only hear about the samples that pass */
+	lunix_sensor_filter(s, BATT, &smp[BATT]);
+	lunix_sensor_filter(s, TEMP, &smp[TEMP]);
+	lunix_sensor_filter(s, LIGHT, &smp[LIGHT]);
+
+	lunix_msr_write_end(s->msr_data[BATT]);
+	lunix_msr_write_end(s->msr_data[TEMP]);
+	lunix_msr_write_end(s->msr_data[LIGHT]);
 
 	/*
-	 * And wake up any sleepers who may be waiting on
-	 * fresh data from this sensor.
+	 * Stream the new samples to the aggregate device too, still
+	 * under the spinlock, so that two TTYs reporting the same node
+	 * cannot publish its records out of seq order. lunix_all_lock
+	 * nests inside it, and is never held while taking it.
 	 */
-	// Changed by me!
-	wake_up_interruptible_all(&s->wq);
+	lunix_all_publish(s, smp);
+	
+	spin_unlock(&s->lock);
+}
+
+void lunix_sensor_update(struct lunix_sensor_struct *s,
+	uint16_t batt, uint16_t temp, uint16_t light)
+{
+	__lunix_sensor_update(s, batt, temp, light);
+	lunix_sensor_wake(s);
 }
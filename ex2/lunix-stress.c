@@ -0,0 +1,299 @@
+/*
+ * lunix-stress.c
+ *
+ * Stress test for the Lunix:TNG line discipline.
+ *
+ * A pseudo-terminal stands in for the base station: the Lunix
+ * line discipline is set on its slave side, and synthetic sensor
+ * packets are written to its master side at a sustained line rate,
+ * then in one unpaced burst much larger than the staging fifo of
+ * the discipline, while many blocking readers follow the sensor
+ * nodes. When done, the counters of the line discipline
+ * [LUNIX_LDISC_IOC_STATS] must account for every byte and every
+ * packet sent. This is done once with inline and once with
+ * deferred processing [lunix_ldisc_deferred].
+ *
+ * Must be run with root privilege, with the module loaded.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <termios.h>
+#include <time.h>
+
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+
+#include "lunix.h"
+#include "lunix-ldisc.h"
+#include "lunix-protocol.h"
+#include "lunix-xmesh.h"
+
+#define STRESS_SENSORS		16
+#define STRESS_BURST		(1 << 20)	/* 256 times the default lunix_ldisc_stage */
+#define DEFERRED_PARAM		"/sys/module/lunix/parameters/lunix_ldisc_deferred"
+
+static const char *msr_names[] = { "batt", "temp", "light" };
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static volatile sig_atomic_t reader_done;
+
+static void reader_term(int sig)
+{
+	reader_done = 1;
+}
+
+/*
+ * A blocking reader of one sensor node, until told to stop.
+ * Reports the number of bytes it got as its exit status.
+ */
+static void reader_child(int i)
+{
+	struct sigaction sa;
+	char path[64], buf[4096];
+	unsigned long bytes;
+	ssize_t r;
+	int fd;
+
+	snprintf(path, sizeof(path), "/dev/lunix%d-%s",
+		i % STRESS_SENSORS, msr_names[(i / STRESS_SENSORS) % 3]);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = reader_term;	/* No SA_RESTART, to break out of read() */
+	sigaction(SIGTERM, &sa, NULL);
+
+	/* The sensor only exists once its first packet is in */
+	while ((fd = open(path, O_RDONLY)) < 0) {
+		if (errno != ENODEV || reader_done) {
+			perror(path);
+			exit(255);
+		}
+		usleep(10000);
+	}
+
+	bytes = 0;
+	while (!reader_done)
+		if ((r = read(fd, buf, sizeof(buf))) > 0)
+			bytes += r;
+
+	exit(bytes > 0 ? 0 : 1);
+}
+
+/*
+ * Open a pseudo-terminal pair in raw mode and set the
+ * Lunix line discipline on its slave side.
+ */
+static int open_pty(int *master, int *slave)
+{
+	struct termios tio;
+	int disc = N_LUNIX_LDISC;
+
+	if ((*master = posix_openpt(O_RDWR | O_NOCTTY)) < 0 ||
+	    grantpt(*master) < 0 || unlockpt(*master) < 0) {
+		perror("/dev/ptmx");
+		return -1;
+	}
+	if ((*slave = open(ptsname(*master), O_RDWR | O_NOCTTY)) < 0) {
+		perror(ptsname(*master));
+		return -1;
+	}
+
+	if (tcgetattr(*slave, &tio) < 0) {
+		perror("tcgetattr");
+		return -1;
+	}
+	cfmakeraw(&tio);
+	cfsetspeed(&tio, B115200);
+	if (tcsetattr(*slave, TCSANOW, &tio) < 0 || tcsetattr(*master, TCSANOW, &tio) < 0) {
+		perror("tcsetattr");
+		return -1;
+	}
+
+	if (ioctl(*slave, TIOCSETD, &disc) < 0) {
+		perror("set ldisc: failed to set line discipline");
+		fprintf(stderr, "Is the Lunix:TNG discipline actually loaded?!\n");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Select inline or deferred processing for
+ * the TTYs the discipline is set on from now on.
+ */
+static int set_deferred(int deferred)
+{
+	FILE *f;
+
+	if (!(f = fopen(DEFERRED_PARAM, "w"))) {
+		perror(DEFERRED_PARAM);
+		return -1;
+	}
+	fprintf(f, "%d\n", deferred);
+	if (fclose(f) != 0) {
+		perror(DEFERRED_PARAM);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Write packets for all sensors, round robin, until limit bytes
+ * have been sent or the deadline has passed. If rate is nonzero,
+ * never get ahead of rate bytes per second.
+ */
+static int write_packets(int master, double rate, double end, unsigned long long limit,
+	unsigned long long *sent, unsigned long long *packets)
+{
+	unsigned char pkt[LUNIX_XMESH_WIRE_MAX];
+	unsigned long long base = *sent;
+	double start, t;
+	int n;
+
+	start = now_sec();
+	while (*sent - base < limit && (t = now_sec()) < end) {
+		if (rate && *sent - base > (t - start) * rate) {
+			usleep(1000);
+			continue;
+		}
+		n = lunix_xmesh_packet(pkt, 1 + *packets % STRESS_SENSORS,
+			rand() & 0x3FF, rand() & 0x3FF, rand(), 0);
+		if (write(master, pkt, n) != n) {
+			perror("write to pty master");
+			return -1;
+		}
+		*sent += n;
+		(*packets)++;
+	}
+	return 0;
+}
+
+/*
+ * Let the TTY layer drain whatever it still holds: poll the
+ * counters until they account for every byte sent, or stop
+ * growing for a whole second.
+ */
+static int wait_stats(int slave, unsigned long long sent, struct lunix_protocol_stats *stats)
+{
+	unsigned long long last = 0;
+	int idle = 0;
+
+	for (;;) {
+		if (ioctl(slave, LUNIX_LDISC_IOC_STATS, stats) < 0) {
+			perror("LUNIX_LDISC_IOC_STATS");
+			return -1;
+		}
+		if (stats->bytes == sent)
+			return 0;
+		if (stats->bytes != last) {
+			last = stats->bytes;
+			idle = 0;
+		} else if (++idle == 10)
+			return 0;
+		usleep(100000);
+	}
+}
+
+/*
+ * One run: a paced phase for secs seconds, then an unpaced burst
+ * of burst bytes, over a fresh pseudo-terminal. Returns 0 on PASS.
+ */
+static int run(int deferred, double secs, int nreaders, int baud, unsigned long long burst)
+{
+	struct lunix_protocol_stats stats;
+	unsigned long long sent, packets, burst_sent;
+	int master, slave, status, failed, ret;
+	double t;
+	pid_t *pids;
+	int i;
+
+	if (set_deferred(deferred) < 0 || open_pty(&master, &slave) < 0)
+		return 1;
+
+	if (!(pids = calloc(nreaders + 1, sizeof(*pids)))) {
+		perror("calloc");
+		return 1;
+	}
+	for (i = 0; i < nreaders; i++)
+		if ((pids[i] = fork()) == 0) {
+			close(master);
+			close(slave);
+			reader_child(i);
+		}
+
+	/* 8N1: ten bits on the wire per byte */
+	srand(1);
+	sent = packets = 0;
+	if (write_packets(master, baud / 10.0, now_sec() + secs, ~0ULL, &sent, &packets) < 0)
+		return 1;
+	burst_sent = sent;
+	t = now_sec();
+	if (write_packets(master, 0, 1e300, burst, &sent, &packets) < 0)
+		return 1;
+	t = now_sec() - t;
+	burst_sent = sent - burst_sent;
+
+	tcdrain(master);
+	if (wait_stats(slave, sent, &stats) < 0)
+		return 1;
+
+	failed = 0;
+	for (i = 0; i < nreaders; i++)
+		kill(pids[i], SIGTERM);
+	for (i = 0; i < nreaders; i++)
+		if (waitpid(pids[i], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status))
+			failed++;
+	free(pids);
+
+	printf("%s: %.1f s at %d baud, then %llu bytes unpaced in %.2f s, %d readers (%d got no data)\n",
+		deferred ? "deferred" : "inline", secs, baud, burst_sent, t, nreaders, failed);
+	printf("sent:     %llu bytes, %llu packets\n", sent, packets);
+	printf("received: %llu bytes, %llu packets, %llu CRC errors, %llu resyncs skipping %llu bytes\n",
+		(unsigned long long)stats.bytes, (unsigned long long)stats.packets,
+		(unsigned long long)stats.crc_errors,
+		(unsigned long long)stats.resyncs, (unsigned long long)stats.resync_bytes);
+
+	close(slave);
+	close(master);
+
+	ret = (stats.bytes != sent || stats.packets != packets ||
+	       stats.crc_errors || stats.resyncs || failed);
+	printf("%s\n", ret ? "FAIL" : "PASS");
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long long burst;
+	int nreaders, baud, ret;
+	double secs;
+
+	secs = (argc > 1) ? atof(argv[1]) : 30.0;
+	nreaders = (argc > 2) ? atoi(argv[2]) : 64;
+	baud = (argc > 3) ? atoi(argv[3]) : 115200;
+	burst = (argc > 4) ? strtoull(argv[4], NULL, 0) : STRESS_BURST;
+	if (secs <= 0 || nreaders < 0 || baud < 10) {
+		fprintf(stderr, "Usage: %s [SECONDS] [NREADERS] [BAUD] [BURST_BYTES]\n", argv[0]);
+		return 1;
+	}
+
+	ret = run(0, secs, nreaders, baud, burst);
+	ret |= run(1, secs, nreaders, baud, burst);
+	set_deferred(0);
+
+	return ret;
+}
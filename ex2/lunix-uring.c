@@ -0,0 +1,241 @@
+/*
+ * lunix-uring.c
+ *
+ * Sample io_uring reader for Lunix:TNG nodes.
+ *
+ * A single thread keeps a read queued on every measurement node
+ * of the first NSENSORS sensors [/dev/lunix<NO>-<TYPE>] and
+ * sleeps in io_uring_enter() until any of them completes. The
+ * driver reads with IOCB_NOWAIT, so io_uring parks each read on
+ * the node's poll wait queue instead of a worker thread.
+ *
+ * Reports the same figures as "lunix-bench blocking", which reads
+ * the same nodes with a blocking reader each, the way test.c does.
+ *
+ * Talks to the kernel directly, to do without liburing.
+ *
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <linux/io_uring.h>
+
+#include "lunix.h"
+#include "lunix-msr.h"
+
+#define URING_MAX_NODES		(16 * 3)	/* 16 sensors, 3 measurements each */
+#define URING_BUFSZ		4096
+
+static const char *msr_names[] = { "batt", "temp", "light" };
+
+/*
+ * The submission and completion rings, as mapped from the kernel
+ */
+struct uring {
+	int fd;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned pending;		/* Queued, not yet submitted */
+};
+
+static int uring_init(struct uring *r, unsigned entries)
+{
+	struct io_uring_params p;
+	char *sq, *cq;
+
+	memset(&p, 0, sizeof(p));
+	if ((r->fd = syscall(__NR_io_uring_setup, entries, &p)) < 0)
+		return -1;
+
+	sq = mmap(NULL, p.sq_off.array + p.sq_entries * sizeof(unsigned),
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	cq = mmap(NULL, p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe),
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+	r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (sq == MAP_FAILED || cq == MAP_FAILED || r->sqes == MAP_FAILED)
+		return -1;
+
+	r->sq_head = (unsigned *)(sq + p.sq_off.head);
+	r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *)(sq + p.sq_off.array);
+	r->cq_head = (unsigned *)(cq + p.cq_off.head);
+	r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	r->pending = 0;
+	return 0;
+}
+
+/* Queue a read of fd into buf, tagged with user_data. */
+static void uring_queue_read(struct uring *r, int fd, void *buf, unsigned len, uint64_t user_data)
+{
+	struct io_uring_sqe *sqe;
+	unsigned tail, idx;
+
+	tail = *r->sq_tail;
+	idx = tail & *r->sq_mask;
+	sqe = &r->sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = len;
+	sqe->user_data = user_data;
+
+	r->sq_array[idx] = idx;
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	r->pending++;
+}
+
+/* Submit what is queued and wait for at least one completion. */
+static int uring_submit_and_wait(struct uring *r)
+{
+	int ret;
+
+	ret = syscall(__NR_io_uring_enter, r->fd, r->pending, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+	if (ret >= 0)
+		r->pending -= ret;
+	return ret;
+}
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double tv_sec(struct timeval *tv)
+{
+	return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+static volatile sig_atomic_t done;
+
+static void on_alarm(int sig)
+{
+	done = 1;
+}
+
+int main(int argc, char *argv[])
+{
+	static char bufs[URING_MAX_NODES][URING_BUFSZ];
+	const struct lunix_msr_data_struct *msr[URING_MAX_NODES];
+	int fds[URING_MAX_NODES];
+	struct lunix_msr_snapshot snap;
+	struct io_uring_cqe *cqe;
+	unsigned long calls, reads, bytes, lat_cnt;
+	double secs, start, wall, user, sys, lat, lat_sum, lat_max;
+	struct sigaction sa;
+	struct rusage ru;
+	struct uring r;
+	unsigned head;
+	char path[64];
+	int i, n, s, m, nsensors;
+
+	secs = (argc > 1) ? atof(argv[1]) : 10.0;
+	nsensors = (argc > 2) ? atoi(argv[2]) : 16;
+	if (secs <= 0 || nsensors < 1 || nsensors * 3 > URING_MAX_NODES) {
+		fprintf(stderr, "Usage: %s [SECONDS] [NSENSORS <= %d]\n", argv[0], URING_MAX_NODES / 3);
+		return 1;
+	}
+
+	n = 0;
+	for (s = 0; s < nsensors; s++)
+		for (m = 0; m < 3; m++) {
+			snprintf(path, sizeof(path), "/dev/lunix%d-%s", s, msr_names[m]);
+			if ((fds[n] = open(path, O_RDONLY)) < 0 || !(msr[n] = lunix_msr_map(fds[n]))) {
+				perror(path);
+				return 1;
+			}
+			n++;
+		}
+
+	if (uring_init(&r, URING_MAX_NODES) < 0) {
+		perror("io_uring_setup");
+		return 1;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_alarm;	/* No SA_RESTART, to break out of io_uring_enter() */
+	sigaction(SIGALRM, &sa, NULL);
+	alarm((unsigned int)secs);
+
+	for (i = 0; i < n; i++)
+		uring_queue_read(&r, fds[i], bufs[i], URING_BUFSZ, i);
+
+	calls = reads = bytes = lat_cnt = 0;
+	lat_sum = lat_max = 0;
+	start = now_sec();
+	while (!done) {
+		calls++;
+		if (uring_submit_and_wait(&r) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("io_uring_enter");
+			return 1;
+		}
+
+		/* Reap every completion and queue the next read on its node */
+		head = *r.cq_head;
+		while (head != __atomic_load_n(r.cq_tail, __ATOMIC_ACQUIRE)) {
+			cqe = &r.cqes[head & *r.cq_mask];
+			i = cqe->user_data;
+			if (cqe->res < 0) {
+				fprintf(stderr, "read(/dev/lunix%d-%s): %s\n",
+					i / 3, msr_names[i % 3], strerror(-cqe->res));
+				return 1;
+			}
+			if (cqe->res > 0) {
+				lunix_msr_snapshot(msr[i], &snap);
+				lat = now_sec() - snap.update_ns / 1e9;
+				reads++;
+				bytes += cqe->res;
+				lat_cnt++;
+				lat_sum += lat;
+				if (lat > lat_max)
+					lat_max = lat;
+			}
+			uring_queue_read(&r, fds[i], bufs[i], URING_BUFSZ, i);
+			head++;
+		}
+		__atomic_store_n(r.cq_head, head, __ATOMIC_RELEASE);
+	}
+	wall = now_sec() - start;
+
+	getrusage(RUSAGE_SELF, &ru);
+	user = tv_sec(&ru.ru_utime);
+	sys = tv_sec(&ru.ru_stime);
+
+	printf("uring: N = %d, %.1f s wall, %.3f s user, %.3f s sys, CPU %.1f%%\n",
+		nsensors, wall, user, sys, 100.0 * (user + sys) / wall);
+	printf("uring: %lu io_uring_enter() calls, %lu reads with data, %lu bytes\n",
+		calls, reads, bytes);
+	if (lat_cnt)
+		printf("uring: update-to-read latency avg %.1f us, max %.1f us\n",
+			1e6 * lat_sum / lat_cnt, 1e6 * lat_max);
+
+	close(r.fd);
+	for (i = 0; i < n; i++) {
+		lunix_msr_unmap(msr[i]);
+		close(fds[i]);
+	}
+	return 0;
+}
@@ -0,0 +1,102 @@
+/*
+ * lunix-xmesh.h
+ *
+ * Header-only userspace helpers for building XMesh sensor
+ * packets, framed and escaped exactly as a base station
+ * puts them on the wire [see lunix-protocol.c].
+ *
+ */
+
+#ifndef _LUNIX_XMESH_H
+#define _LUNIX_XMESH_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "lunix.h"
+#include "lunix-protocol.h"
+
+#define LUNIX_XMESH_PAYLOAD_LEN	29
+
+/*
+ * Worst case length of a packet on the wire:
+ * everything but the start and end bytes escaped.
+ */
+#define LUNIX_XMESH_WIRE_MAX	(2 * (10 + LUNIX_XMESH_PAYLOAD_LEN))
+
+/*
+ * CRC-16 as computed by the motes [TinyOS crcByte()]
+ */
+static inline uint16_t lunix_xmesh_crc_byte(uint16_t crc, uint8_t b)
+{
+	int i;
+
+	crc ^= b << 8;
+	for (i = 0; i < 8; i++)
+		crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+	return crc;
+}
+
+/* Append b to the stream, escaping it if it is special. */
+static inline int lunix_xmesh_put_escaped(unsigned char *out, uint8_t b)
+{
+	if (b == 0x7E || b == 0x7D) {
+		out[0] = 0x7D;
+		out[1] = b ^ 0x20;
+		return 2;
+	}
+	out[0] = b;
+	return 1;
+}
+
+/*
+ * Build a framed sensor packet for a node into out, returning
+ * its length on the wire. The rest of the payload is random.
+ * If corrupt is set, the packet is damaged after its CRC has
+ * been computed.
+ */
+static inline int lunix_xmesh_packet(unsigned char *out, uint16_t node,
+	uint16_t batt, uint16_t temp, uint16_t light, int corrupt)
+{
+	unsigned char pkt[7 + LUNIX_XMESH_PAYLOAD_LEN];
+	uint16_t crc;
+	int i, n;
+
+	memset(pkt, 0, sizeof(pkt));
+	pkt[0] = 0x7E;				/* Start byte */
+	pkt[1] = 0x42;				/* Packet type */
+	pkt[2] = 0xFF; pkt[3] = 0xFF;		/* Destination address */
+	pkt[PACKET_SIGNATURE_OFFSET] = 0x0B;	/* AM type: sensor data */
+	pkt[5] = 0x7D;				/* AM group, escaped on the wire */
+	pkt[6] = LUNIX_XMESH_PAYLOAD_LEN;
+	for (i = 7; i < (int)sizeof(pkt); i++)
+		pkt[i] = rand();
+	pkt[NODE_OFFSET] = node & 0xFF;
+	pkt[NODE_OFFSET + 1] = node >> 8;
+	pkt[VREF_OFFSET] = batt & 0xFF;
+	pkt[VREF_OFFSET + 1] = batt >> 8;
+	pkt[TEMPERATURE_OFFSET] = temp & 0xFF;
+	pkt[TEMPERATURE_OFFSET + 1] = temp >> 8;
+	pkt[LIGHT_OFFSET] = light & 0xFF;
+	pkt[LIGHT_OFFSET + 1] = light >> 8;
+
+	crc = 0;
+	for (i = 1; i < (int)sizeof(pkt); i++)
+		crc = lunix_xmesh_crc_byte(crc, pkt[i]);
+	if (corrupt)
+		pkt[LIGHT_OFFSET] ^= 0x01;
+
+	n = 0;
+	out[n++] = pkt[0];
+	out[n++] = pkt[1];
+	for (i = 2; i < (int)sizeof(pkt); i++)
+		n += lunix_xmesh_put_escaped(out + n, pkt[i]);
+	n += lunix_xmesh_put_escaped(out + n, crc & 0xFF);
+	n += lunix_xmesh_put_escaped(out + n, crc >> 8);
+	out[n++] = 0x7E;			/* End byte */
+
+	return n;
+}
+
+#endif	/* _LUNIX_XMESH_H */
@@ -13,12 +13,29 @@
 /* Compile-time parameters */
 #define LUNIX_VERSION_STRING	"0.1701-D"
 
+/*
+ * The measurements reported by each sensor
+ */
+enum lunix_msr_enum { BATT = 0, TEMP, LIGHT, N_LUNIX_MSR };
+
+/*
+ * Predicates an open measurement node can filter its samples
+ * with, see LUNIX_IOC_SET_FILTER in lunix-chrdev.h
+ */
+#define LUNIX_FILTER_CROSS	0x1	/* Crossed the low or the high limit */
+#define LUNIX_FILTER_DELTA	0x2	/* Moved by delta since the last one delivered */
+#define LUNIX_FILTER_INTERVAL	0x4	/* At least interval_ms after the last one delivered */
+#define LUNIX_FILTER_EVERY	0x8	/* Every Nth of the samples that qualify */
+
 #ifdef __KERNEL__ 
 
 #include <linux/fs.h>
 #include <linux/tty.h>
+#include <linux/atomic.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
+#include <linux/seqlock.h>
+#include <linux/xarray.h>
 
 /*
  * A structure representing a hardware sensor
@@ -27,8 +44,103 @@
 
 #define LUNIX_MSR_MAGIC 0xF00DF00D
 
-enum lunix_msr_enum { BATT = 0, TEMP, LIGHT, N_LUNIX_MSR };
+/*
+ * A consumer group on a measurement: open files that join the same
+ * group share a single cursor, so that each sample is handed to
+ * exactly one of them. Members sleep exclusively on the group's
+ * wait queue and every update wakes up only one of them.
+ */
+#define LUNIX_MSR_GROUPS	8	/* Group ids are 1 .. LUNIX_MSR_GROUPS */
+
+struct lunix_msr_group_struct {
+	atomic64_t seq;		/* Last sample consumed by the group */
+	int members;
+	wait_queue_head_t wq;
+};
+
+/*
+ * A single measurement, as kept in the per-sensor history ring.
+ * The cooked value and its textual form are computed once, when
+ * the sample is stored, and shared by all readers; seq tells
+ * them apart.
+ */
+#define LUNIX_MSR_TEXTSZ	10	/* Width of the formatted cooked value */
+
+/*
+ * Where a stream of samples stands against a filter: the zone of
+ * the previous sample [-1 below low, 0 within the limits, 1 above
+ * high], the value and receive time of the last one that passed,
+ * and how many have qualified since.
+ */
+struct lunix_filter_ref {
+	int32_t zone;
+	int32_t last;
+	uint64_t last_ns;
+	uint32_t count;
+};
+
+/*
+ * A filter set by an open file on a measurement. The update path
+ * tests every new sample against it, under the sensor spinlock,
+ * and only wakes up the file's own wait queue for samples that
+ * pass. The reader tests the same samples again as it consumes
+ * them, against its own copy of ref, to tell which ones those were.
+ */
+struct lunix_msr_filter_struct {
+	struct list_head list;		/* On the sensor's filters[], while flags != 0 */
+	unsigned int flags;
+	int32_t low, high, delta;
+	uint64_t interval_ns;
+	uint32_t every;
+	struct lunix_filter_ref ref;	/* As of the latest sample */
+	uint64_t pass_seq;		/* Sequence number of the latest sample that passed */
+	int kick;			/* ... if its wait queue has not been woken for it yet */
+	wait_queue_head_t wq;
+};
+
+struct lunix_msr_sample_struct {
+	uint64_t seq;		/* Per-measurement update sequence, starting at 1 */
+	uint64_t timestamp;	/* Monotonic receive time, in ns */
+	uint32_t value;		/* Raw 16-bit value */
+	int32_t cooked;		/* Converted value, in thousandths */
+	unsigned char text[LUNIX_MSR_TEXTSZ];
+};
+
+/*
+ * Windowed aggregates of the cooked values of a measurement are kept
+ * in a ring of LUNIX_AGGR_BUCKETS buckets, each covering 1/LUNIX_AGGR_BUCKETS
+ * of lunix_aggr_window seconds of receive time. A bucket is recycled
+ * when the first sample of a newer period lands in it, so the buckets
+ * whose epoch is within LUNIX_AGGR_BUCKETS of the current one make up
+ * a sliding window, advancing one bucket at a time.
+ */
+#define LUNIX_AGGR_BUCKETS	60
+#define LUNIX_AGGR_WINDOW	60	/* Default window, in seconds */
+extern int lunix_aggr_window;
+
+struct lunix_aggr_bucket {
+	uint64_t epoch;		/* Receive time / bucket width */
+	int64_t sum;
+	uint32_t count;
+	int32_t min;
+	int32_t max;
+};
+
+/*
+ * The fields of a sensor are laid out by who writes them, each group on
+ * cache lines of its own, and sensors never share a line either: an
+ * update of one sensor, or readers queueing up on it, must not bounce
+ * the lines that the readers and the update path of another are using.
+ */
 struct lunix_sensor_struct {
+	/*
+	 * Read-mostly: set up by lunix_sensor_init(), only read afterwards.
+	 *
+	 * The sensor number, i.e. the node id of the mote - 1,
+	 * as in /dev/lunix<id>-*
+	 */
+	unsigned int id;
+
 	/*
 	 * A number of pages, one for each measurement.
 	 * They can be mapped to userspace.
@@ -36,25 +148,111 @@ struct lunix_sensor_struct {
 	struct lunix_msr_data_struct *msr_data[N_LUNIX_MSR];
 
 	/*
+	 * A ring of the lunix_sensor_hist most recent samples
+	 * for each measurement, see msr_seq below.
+	 */
+	struct lunix_msr_sample_struct *hist[N_LUNIX_MSR];
+
+	/*
+	 * Buckets of windowed aggregates for each measurement,
+	 * protected by the spinlock
+	 */
+	struct lunix_aggr_bucket *aggr[N_LUNIX_MSR];
+
+	/*
+	 * Writer-hot: rewritten by every update.
+	 *
 	 * Spinlock used to assert mutual exclusion between
 	 * the serial line discipline and the character device driver
 	 */
-	spinlock_t lock;
+	spinlock_t lock ____cacheline_aligned_in_smp;
 
 	/*
-	 * A list of processes waiting to be woken up
-	 * when this sensor has been updated with new data
+	 * msr_seq[] is the sequence number of the latest sample in
+	 * hist[], which lives in slot msr_seq & (lunix_sensor_hist - 1);
+	 * zero means no sample has been received yet.
+	 *
+	 * Both are only written under the spinlock, inside a write
+	 * section of hist_seqc[], so that readers can copy samples
+	 * out without taking the spinlock, retrying if they raced
+	 * with an update.
 	 */
-	wait_queue_head_t wq;
-};
+	uint64_t msr_seq[N_LUNIX_MSR];
+	seqcount_t hist_seqc[N_LUNIX_MSR];
+
+	/*
+	 * Filters set by open files on each measurement,
+	 * protected by the spinlock
+	 */
+	struct list_head filters[N_LUNIX_MSR];
+
+	/*
+	 * Whether the sensor has been updated by a deferred batch
+	 * and not woken up yet [bit LUNIX_SENSOR_TOUCHED], in which
+	 * case it is on the touched list of the TTY that set the bit,
+	 * see lunix_sensor_touch()
+	 */
+	unsigned long touched_flags;
+	struct list_head touched;
+
+	/*
+	 * Reader-hot: written by readers going to sleep and waking up,
+	 * and by consumer group members moving their shared cursors.
+	 *
+	 * Lists of processes waiting to be woken up when this
+	 * sensor has been updated with new data, one per measurement
+	 * so that e.g. LIGHT readers sleep through a BATT update.
+	 */
+	wait_queue_head_t wq[N_LUNIX_MSR] ____cacheline_aligned_in_smp;
+
+	/*
+	 * Consumer groups, protected by the spinlock
+	 */
+	struct lunix_msr_group_struct groups[N_LUNIX_MSR][LUNIX_MSR_GROUPS];
+} ____cacheline_aligned_in_smp;
+
+#define LUNIX_SENSOR_TOUCHED	0
 
 /*
- * The default value for the maximum number of sensors supported
+ * The default value for the maximum number of sensors supported:
+ * node ids are 16-bit, and only the sensors actually heard from
+ * take up any memory
  */
-#define LUNIX_SENSOR_CNT			16
+#define LUNIX_SENSOR_CNT			65535
 extern int lunix_sensor_cnt;
-extern struct lunix_sensor_struct *lunix_sensors;
-extern struct lunix_protocol_state_struct lunix_protocol_state;
+
+/*
+ * The default number of samples kept per measurement,
+ * always rounded up to a power of two, and the most allowed:
+ * a new sensor's rings are allocated from the packet path,
+ * in atomic context, so they must stay small
+ */
+#define LUNIX_SENSOR_HIST			16
+#define LUNIX_SENSOR_HIST_MAX			1024
+extern int lunix_sensor_hist;
+
+/*
+ * With lunix_msr_packed set, the measurement records of the first
+ * lunix_msr_packed_ids sensors live in a single table, laid out as
+ * described below struct lunix_msr_data_struct, instead of in a page
+ * each; the table takes 256 bytes per id, whether heard from or not.
+ * Sensors past it, and all of them without lunix_msr_packed, keep a
+ * page per record. lunix_msr_table is NULL then.
+ */
+#define LUNIX_MSR_PACKED_IDS			1024
+extern int lunix_msr_packed;
+extern int lunix_msr_packed_ids;
+extern void *lunix_msr_table;
+extern unsigned long lunix_msr_table_size;
+
+/*
+ * The sensors, indexed by sensor number. Each is allocated on its first
+ * packet [see lunix_sensor_get_or_create()] and kept until the module is
+ * unloaded. New sensors are marked LUNIX_SENSOR_NEW until their device
+ * nodes have been created.
+ */
+extern struct xarray lunix_sensor_xa;
+#define LUNIX_SENSOR_NEW	XA_MARK_0
 
 /*
  * Debugging
@@ -69,10 +267,26 @@ extern struct lunix_protocol_state_struct lunix_protocol_state;
 /*
  * Function prototypes
  */
-int lunix_sensor_init(struct lunix_sensor_struct *);
+struct lunix_aggr;
+
+int lunix_msr_table_init(void);
+void lunix_msr_table_destroy(void);
+int lunix_sensors_init(void);
+void lunix_sensors_destroy(void);
+struct lunix_sensor_struct *lunix_sensor_get(unsigned int id);
+struct lunix_sensor_struct *lunix_sensor_get_or_create(unsigned int id, gfp_t gfp);
+int lunix_sensor_init(struct lunix_sensor_struct *, unsigned int id, gfp_t gfp);
 void lunix_sensor_destroy(struct lunix_sensor_struct *);
 void lunix_sensor_update(struct lunix_sensor_struct *s,
 	uint16_t batt, uint16_t temp, uint16_t light);
+void __lunix_sensor_update(struct lunix_sensor_struct *s,
+	uint16_t batt, uint16_t temp, uint16_t light);
+void __lunix_sensor_wake(struct lunix_sensor_struct *s);
+void lunix_sensor_touch(struct lunix_sensor_struct *s, struct list_head *touched);
+void lunix_sensor_wake_touched(struct list_head *touched);
+void lunix_sensor_wake(struct lunix_sensor_struct *s);
+void lunix_sensor_aggr(struct lunix_sensor_struct *s, int type,
+	unsigned int window_ms, struct lunix_aggr *aggr);
 
 #else
 #include <inttypes.h>
@@ -81,13 +295,128 @@ void lunix_sensor_update(struct lunix_sensor_struct *s,
  * A structure, living at the start of a page, containing a version number
  * [timestamp of last update] and a variable number of 32-bit quantities. It is
  * meant to be mappable to userspace.
+ *
+ * seq is a sequence counter guarding the rest of the structure: it is odd
+ * while lunix_sensor_update() is rewriting it and is bumped again when done.
+ * Readers of the mapping use it to detect torn snapshots, see lunix-msr.h.
+ *
+ * update_seq and update_ns are the update sequence number and the monotonic
+ * receive time [in ns] of the sample in values[0]; unlike last_update, they
+ * tell apart updates that arrive within the same second.
  */
 struct lunix_msr_data_struct {
 	uint32_t magic;
 	uint32_t last_update;
+	uint32_t seq;
+	uint32_t __pad;
+	uint64_t update_seq;
+	uint64_t update_ns;
 	uint32_t values[];
 };
 
+/*
+ * The packed layout of measurement records [see the lunix_msr_packed
+ * module parameter]: every sensor gets LUNIX_MSR_SLOTS slots of
+ * LUNIX_MSR_SLOTSZ bytes in the table, one per measurement, so the
+ * record of measurement type of /dev/lunix<NO>-* is at byte offset
+ * (NO * LUNIX_MSR_SLOTS + type) * LUNIX_MSR_SLOTSZ, and a 4 KiB page
+ * holds the records of a block of 16 sensors. Each record has a
+ * cache line to itself.
+ */
+#define LUNIX_MSR_SLOTSZ	64
+#define LUNIX_MSR_SLOTS		4	/* N_LUNIX_MSR of them used */
+
+/*
+ * A single update of one measurement, in binary form, as streamed by
+ * /dev/lunix-all and returned by LUNIX_IOC_GET_SAMPLES
+ */
+struct lunix_record {
+	uint16_t node;		/* Node id of the mote, /dev/lunix<node - 1>-* */
+	uint16_t type;		/* BATT, TEMP or LIGHT */
+	uint32_t raw;		/* Raw 16-bit value */
+	int32_t cooked;		/* Converted value, in thousandths */
+	uint32_t __pad;
+	uint64_t seq;		/* Per-measurement update sequence, starting at 1 */
+	uint64_t timestamp;	/* Monotonic receive time, in ns */
+};
+
+/*
+ * Aggregates of the cooked values of a measurement over a window
+ * of recent receive time, see LUNIX_IOC_GET_AGGR in lunix-chrdev.h
+ */
+struct lunix_aggr {
+	uint32_t window_ms;	/* Window covered [rounded up to whole buckets] */
+	uint32_t count;		/* Samples received within it */
+	int32_t min;		/* In thousandths, like struct lunix_record */
+	int32_t max;
+	int32_t mean;
+	uint32_t __pad;
+};
+
+#ifdef __KERNEL__
+static inline void lunix_record_fill(struct lunix_record *rec, struct lunix_sensor_struct *s,
+	int type, const struct lunix_msr_sample_struct *smp)
+{
+	rec->node = s->id + 1;
+	rec->type = type;
+	rec->raw = smp->value;
+	rec->cooked = smp->cooked;
+	rec->__pad = 0;
+	rec->seq = smp->seq;
+	rec->timestamp = smp->timestamp;
+}
+
+/* Whether the records of a sensor live in the packed table */
+static inline int lunix_msr_in_table(struct lunix_sensor_struct *s)
+{
+	return lunix_msr_table && s->id < lunix_msr_packed_ids;
+}
+
+static inline unsigned long lunix_msr_table_offset(struct lunix_sensor_struct *s, int type)
+{
+	return ((unsigned long)s->id * LUNIX_MSR_SLOTS + type) * LUNIX_MSR_SLOTSZ;
+}
+
+static inline int lunix_filter_zone(const struct lunix_msr_filter_struct *f, int32_t v)
+{
+	return (v < f->low) ? -1 : (v > f->high) ? 1 : 0;
+}
+
+/*
+ * Test the next sample of a stream against a filter,
+ * moving ref past it. Returns whether the sample passes.
+ */
+static inline int lunix_filter_pass(const struct lunix_msr_filter_struct *f,
+	struct lunix_filter_ref *ref, const struct lunix_msr_sample_struct *smp)
+{
+	int64_t d = (int64_t)smp->cooked - ref->last;
+	int zone = lunix_filter_zone(f, smp->cooked);
+	int pass;
+
+	/* Without a predicate on the value, every sample qualifies */
+	pass = !(f->flags & (LUNIX_FILTER_CROSS | LUNIX_FILTER_DELTA));
+	if ((f->flags & LUNIX_FILTER_CROSS) && zone != ref->zone)
+		pass = 1;
+	if ((f->flags & LUNIX_FILTER_DELTA) && (d < 0 ? -d : d) >= f->delta)
+		pass = 1;
+	ref->zone = zone;
+
+	/* Decimation and rate limiting then thin out those that do */
+	if (pass && (f->flags & LUNIX_FILTER_EVERY) && ++ref->count < f->every)
+		pass = 0;
+	if (pass && (f->flags & LUNIX_FILTER_INTERVAL) && ref->last_ns &&
+	    smp->timestamp - ref->last_ns < f->interval_ns)
+		pass = 0;
+
+	if (pass) {
+		ref->last = smp->cooked;
+		ref->last_ns = smp->timestamp;
+		ref->count = 0;
+	}
+	return pass;
+}
+#endif
+
 /*
  * Lunix:TNG line discipline number:
  * Hijack the "Mobitex module" line discipline, since the number
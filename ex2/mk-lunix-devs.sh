@@ -6,9 +6,16 @@ mknod /dev/ttyS1 c 4 65
 mknod /dev/ttyS2 c 4 66
 mknod /dev/ttyS3 c 4 67
 
-# Lunix:TNG nodes: 16 sensors, each has 3 nodes.
+# Lunix:TNG nodes: 16 sensors, each has 3 nodes. With devtmpfs or udev,
+# the nodes of every sensor are also created [class "lunix"] as soon as
+# it is first heard from, whatever its node id. Opening the node of a
+# sensor not heard from yet fails with ENODEV.
 for sensor in $(seq 0 1 15); do
 	mknod /dev/lunix$sensor-batt c 60 $[$sensor * 8 + 0]
 	mknod /dev/lunix$sensor-temp c 60 $[$sensor * 8 + 1]
 	mknod /dev/lunix$sensor-light c 60 $[$sensor * 8 + 2]
 done
+
+# /dev/lunix-all is a misc device with a dynamic minor,
+# its node is created by devtmpfs or udev, with mode 0660:
+# it streams every sensor, so hand its group out with care.
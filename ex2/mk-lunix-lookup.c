@@ -5,6 +5,13 @@
  * lookup tables for converting 16-bit raw measurements
  * from the wireless sensors to actual floating point values.
  *
+ * The sensors only produce 10-bit ADC readings, so the tables only
+ * cover [0, LUNIX_ADC_RANGE) and hold 32-bit entries. Out-of-range
+ * values and the [linear] light conversion are computed inline in
+ * fixed point. Built with -DLUNIX_LOOKUP_CHECK, this program instead
+ * verifies that the generated lunix-lookup.h agrees with the
+ * floating point conversions below for every 16-bit input.
+ *
  * Ioannis Panagopoulos <ioannis@cslab.ece.ntua.gr>
  * Vangelis Koukis <vkoukis@cslab.ece.ntua.gr>
  *
@@ -66,60 +73,111 @@ long uint16_to_temp(uint16_t value)
 	return (l < -272150) ?  -272150 : l;
 }
 
-int main(void)
+/*
+ * Parameters of the compact representation
+ */
+#define ADC_RANGE	1024
+#define LIGHT_SHIFT	28
+
+#ifndef LUNIX_LOOKUP_CHECK
+
+static void print_table(const char *name, long (*fn)(uint16_t))
 {
 	unsigned int i;
 
+	fprintf(stdout, "static const int32_t %s[LUNIX_ADC_RANGE] = {\n", name);
+	for (i = 0; i < ADC_RANGE; i += 4) {
+		fprintf(stdout, "\t%ld, %ld, %ld, %ld",
+			fn(i), fn(i+1), fn(i+2), fn(i+3));
+		fprintf(stdout, (i != ADC_RANGE - 4) ? ",\n" : "\n");
+	}
+	fprintf(stdout, "};\n\n");
+}
+
+int main(void)
+{
 	fprintf(stdout,
 		"/*\n"
-		" * lunix-tables.h\n"
+		" * lunix-lookup.h\n"
 		" *\n"
 		" * Machine-generated file. DO NOT EDIT.\n"
 		" * See %s instead.\n"
 		" *\n"
 		" * Instead of doing floating-point in kernelspace,\n"
-		" * use the following lookup tables to convert 16-bit\n"
-		" * raw measurements to floating point values.\n"
+		" * use the following lookup tables and fixed-point\n"
+		" * helpers to convert 16-bit raw measurements\n"
+		" * to values in thousandths.\n"
 		" */\n"
 		"\n"
-		"long lookup_temperature[65536] = {\n", __FILE__);
+		"#define LUNIX_ADC_RANGE %d\n"
+		"#define LUNIX_BATT_SCALE %dUL\n"
+		"#define LUNIX_LIGHT_MULT %lluULL\n"
+		"#define LUNIX_LIGHT_SHIFT %d\n"
+		"\n", __FILE__, ADC_RANGE,
+		(int)lround(1.223 * 1023.0 * 1000),
+		(unsigned long long)ceil(5000000.0 * (1ULL << LIGHT_SHIFT) / 65535),
+		LIGHT_SHIFT);
 
 	/*
-	 * Temperature
+	 * Temperature and Battery Voltage
 	 */
-	for (i = 0; i <= 0xFFFC; i += 4) {
-		fprintf(stdout, "\t%ld, %ld, %ld, %ld",
-			uint16_to_temp(i), uint16_to_temp(i+1),
-			uint16_to_temp(i+2), uint16_to_temp(i+3));
-		fprintf(stdout, (i != 0xFFFC) ? ",\n" : "\n");
-	}
-
-	fprintf(stdout, "};\n\n"
-		"long lookup_voltage[65536] = {\n");
+	print_table("lookup_temperature", uint16_to_temp);
+	print_table("lookup_voltage", uint16_to_batt);
 
 	/*
-	 * Battery Voltage
+	 * Inline conversions. Temperature saturates at the ADC
+	 * full scale, voltage falls back to an integer division
+	 * and light is linear.
 	 */
-	for (i = 0; i <= 0xFFFC; i += 4) {
-		fprintf(stdout, "\t%ld, %ld, %ld, %ld",
-			uint16_to_batt(i), uint16_to_batt(i+1),
-			uint16_to_batt(i+2), uint16_to_batt(i+3));
-		fprintf(stdout, (i != 0xFFFC) ? ",\n" : "\n");
-	}
-	fprintf(stdout, "};\n\n"
-		"long lookup_light[65536] = {\n");
+	fprintf(stdout,
+		"static inline long lunix_lookup_temperature(uint16_t value)\n"
+		"{\n"
+		"\treturn lookup_temperature[(value < LUNIX_ADC_RANGE) ? value : LUNIX_ADC_RANGE - 1];\n"
+		"}\n\n"
+		"static inline long lunix_lookup_voltage(uint16_t value)\n"
+		"{\n"
+		"\treturn (value < LUNIX_ADC_RANGE) ? lookup_voltage[value] : (long)(LUNIX_BATT_SCALE / value);\n"
+		"}\n\n"
+		"static inline long lunix_lookup_light(uint16_t value)\n"
+		"{\n"
+		"\treturn (long)((value * LUNIX_LIGHT_MULT) >> LUNIX_LIGHT_SHIFT);\n"
+		"}\n");
 
-	/*
-	 * Light
-	 */
-	for (i = 0; i <= 0xFFFC; i += 4) {
-		fprintf(stdout, "\t%ld, %ld, %ld, %ld",
-			uint16_to_light(i), uint16_to_light(i+1),
-			uint16_to_light(i+2), uint16_to_light(i+3));
-		fprintf(stdout, (i != 0xFFFC) ? ",\n" : "\n");
-	}
+	return 0;
+}
 
-	fprintf(stdout, "};\n\n");
+#else	/* LUNIX_LOOKUP_CHECK */
+
+#include "lunix-lookup.h"
+
+static int check(const char *name, long (*ref)(uint16_t), long (*compact)(uint16_t))
+{
+	unsigned int i;
+	int bad = 0;
+
+	for (i = 0; i <= 0xFFFF; i++)
+		if (ref(i) != compact(i)) {
+			if (bad++ < 10)
+				fprintf(stderr, "%s: mismatch for raw value %u: %ld != %ld\n",
+					name, i, ref(i), compact(i));
+		}
+
+	return bad;
+}
+
+int main(void)
+{
+	int bad;
+
+	bad = check("temperature", uint16_to_temp, lunix_lookup_temperature);
+	bad += check("voltage", uint16_to_batt, lunix_lookup_voltage);
+	bad += check("light", uint16_to_light, lunix_lookup_light);
+	if (bad) {
+		fprintf(stderr, "lunix-lookup.h disagrees with the reference conversions for %d values\n", bad);
+		return 1;
+	}
 
 	return 0;
 }
+
+#endif	/* LUNIX_LOOKUP_CHECK */
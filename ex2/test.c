@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <signal.h>
 #include <sys/ioctl.h>
@@ -7,6 +8,7 @@
 #include <fcntl.h>
 #include "lunix-chrdev.h"
 #include "lunix.h"
+#include "lunix-msr.h"
 
 int main(int argc, char *argv[]){
     if(argc == 1) {
@@ -67,14 +69,142 @@ int main(int argc, char *argv[]){
             kill(p[i], SIGKILL);
         }
     }else if(!strcmp(argv[1], "mmap")) {
-        struct lunix_msr_data_struct *t = mmap(NULL, 4096, PROT_READ, MAP_PRIVATE, fd, 0);
+        const struct lunix_msr_data_struct *t = lunix_msr_map(fd);
+        struct lunix_msr_snapshot snap;
     
         printf("%p\n", t);
+        if(!t) return 1;
 
         while(1) {
-            printf("%d\n", t->values[0]);
+            lunix_msr_snapshot(t, &snap);
+            printf("%u (update %llu at %llu ns)\n", snap.value,
+                (unsigned long long)snap.update_seq, (unsigned long long)snap.update_ns);
             sleep(1);
         }
+    }else if(!strcmp(argv[1], "table")) {
+        // With lunix_msr_packed=1: the latest TEMP of the first N sensors, through one mapping
+        int n = (argc > 3) ? atoi(argv[3]) : 16;
+        struct lunix_msr_snapshot snap;
+        struct lunix_msr_table t;
+
+        if(lunix_msr_table_map(fd, 0, n, &t) < 0) {
+            perror("lunix_msr_table_map");
+            return 1;
+        }
+
+        while(1) {
+            for(int i = 0; i < n; i++) {
+                lunix_msr_snapshot(lunix_msr_table_record(&t, i, TEMP), &snap);
+                printf("%u ", snap.value);
+            }
+            printf("\n");
+            sleep(1);
+        }
+    }else if(!strcmp(argv[1], "aggr")) {
+        struct lunix_aggr aggr;
+
+        // Poll the aggregates over the window given in ms, 0 for the longest one
+        while(1) {
+            aggr.window_ms = (argc > 3) ? atoi(argv[3]) : 0;
+            if(ioctl(fd, LUNIX_IOC_GET_AGGR, &aggr) < 0) {
+                perror("LUNIX_IOC_GET_AGGR");
+                return 1;
+            }
+            printf("last %u ms: %u samples, min %d, max %d, mean %d (thousandths)\n",
+                aggr.window_ms, aggr.count, aggr.min, aggr.max, aggr.mean);
+            sleep(1);
+        }
+    }else if(!strcmp(argv[1], "samples")) {
+        struct lunix_record recs[16];
+        struct lunix_samples smp;
+
+        // Block in the ioctl rather than spin
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+        while(1) {
+            smp.records = (uintptr_t)recs;
+            smp.count = 16;
+            if(ioctl(fd, LUNIX_IOC_GET_SAMPLES, &smp) < 0) {
+                perror("LUNIX_IOC_GET_SAMPLES");
+                return 1;
+            }
+            for(unsigned int i = 0; i < smp.count; i++)
+                printf("node %u type %u #%llu at %llu ns: raw %u, cooked %s%d.%03d\n",
+                    recs[i].node, recs[i].type, (unsigned long long)recs[i].seq,
+                    (unsigned long long)recs[i].timestamp, recs[i].raw,
+                    recs[i].cooked < 0 ? "-" : "", abs(recs[i].cooked) / 1000, abs(recs[i].cooked) % 1000);
+        }
+    }else if(!strcmp(argv[1], "backlog")) {
+        // Let samples pile up for SECONDS, then drain all of them with a single read()
+        int secs = (argc > 3) ? atoi(argv[3]) : 5;
+        uint64_t hist = (argc > 4) ? atoi(argv[4]) : 16; // lunix_sensor_hist, 16 by default
+        const struct lunix_msr_data_struct *t = lunix_msr_map(fd);
+        struct lunix_msr_snapshot before, after;
+        char buf[4096];
+        uint64_t expect;
+        ssize_t n;
+
+        if(!t) {
+            perror("lunix_msr_map");
+            return 1;
+        }
+
+        // Catch up first, so that only what arrives from now on is unread
+        while(read(fd, buf, sizeof(buf)) > 0);
+        lunix_msr_snapshot(t, &before);
+        sleep(secs);
+        lunix_msr_snapshot(t, &after);
+
+        n = read(fd, buf, sizeof(buf));
+        if(n < 0) {
+            perror("read");
+            return 1;
+        }
+
+        // Everything up to after.update_seq was unread, as much of it as the ring and buf hold
+        expect = after.update_seq - before.update_seq;
+        if(expect > hist) expect = hist;
+        if(expect > sizeof(buf) / LUNIX_CHRDEV_RECSZ) expect = sizeof(buf) / LUNIX_CHRDEV_RECSZ;
+        printf("%llu updates in %d s, one read() returned %zd samples\n",
+            (unsigned long long)(after.update_seq - before.update_seq), secs, n / LUNIX_CHRDEV_RECSZ);
+        if((uint64_t)n / LUNIX_CHRDEV_RECSZ < expect) {
+            printf("FAIL: expected at least %llu\n", (unsigned long long)expect);
+            return 1;
+        }
+        printf("OK\n");
+    }else if(!strcmp(argv[1], "filter")) {
+        struct lunix_filter filter = { 0 };
+        char buf[256];
+        ssize_t n;
+
+        // DELTA <thousandths> or CROSS <low> <high>, in thousandths, RATE <ms> or EVERY <n>
+        if(argc > 4 && !strcmp(argv[3], "RATE")) {
+            filter.flags = LUNIX_FILTER_INTERVAL;
+            filter.interval_ms = atoi(argv[4]);
+        }else if(argc > 4 && !strcmp(argv[3], "EVERY")) {
+            filter.flags = LUNIX_FILTER_EVERY;
+            filter.every = atoi(argv[4]);
+        }else if(argc > 4 && !strcmp(argv[3], "DELTA")) {
+            filter.flags = LUNIX_FILTER_DELTA;
+            filter.delta = atoi(argv[4]);
+        }else if(argc > 5 && !strcmp(argv[3], "CROSS")) {
+            filter.flags = LUNIX_FILTER_CROSS;
+            filter.low = atoi(argv[4]);
+            filter.high = atoi(argv[5]);
+        }else {
+            printf("Usage: ./test filter [FILE] DELTA [D] | CROSS [LOW] [HIGH] | RATE [MS] | EVERY [N]\n");
+            return 1;
+        }
+        if(ioctl(fd, LUNIX_IOC_SET_FILTER, &filter) < 0) {
+            perror("LUNIX_IOC_SET_FILTER");
+            return 1;
+        }
+
+        // Sleep in read() until a sample passes
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+        while((n = read(fd, buf, sizeof(buf))) > 0) {
+            fwrite(buf, 1, n, stdout);
+            fflush(stdout);
+        }
     }
     
     return 0;
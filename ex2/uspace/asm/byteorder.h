@@ -0,0 +1 @@
+#include <lunix-uspace.h>
@@ -0,0 +1,74 @@
+/*
+ * lunix-uspace.h
+ *
+ * Just enough of the kernel API to build the Lunix:TNG
+ * protocol code as a userspace program, for benchmarking
+ * and testing it without a running kernel.
+ *
+ * The headers under uspace/linux and uspace/asm all include
+ * this file; build with -D__KERNEL__ -Iuspace.
+ *
+ */
+
+#ifndef _LUNIX_USPACE_H
+#define _LUNIX_USPACE_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <endian.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+
+typedef struct { int unused; } spinlock_t;
+typedef struct { int unused; } wait_queue_head_t;
+typedef struct { unsigned int sequence; } seqcount_t;
+typedef struct { int64_t counter; } atomic64_t;
+typedef unsigned int gfp_t;
+
+struct xarray;
+
+struct list_head {
+	struct list_head *next, *prev;
+};
+
+#define KERN_ERR	""
+#define KERN_WARNING	""
+#define KERN_INFO	""
+#define KERN_DEBUG	""
+#define KERN_CONT	""
+#define printk(fmt, arg...)	fprintf(stderr, fmt, ##arg)
+#define printk_ratelimited	printk
+
+#define min(a, b)	((a) < (b) ? (a) : (b))
+#define max(a, b)	((a) > (b) ? (a) : (b))
+
+#define ____cacheline_aligned_in_smp	__attribute__((aligned(64)))
+
+#define GFP_ATOMIC	0U
+
+#define likely(x)	__builtin_expect(!!(x), 1)
+#define unlikely(x)	__builtin_expect(!!(x), 0)
+
+#define READ_ONCE(x)		(*(volatile __typeof__(x) *)&(x))
+#define WRITE_ONCE(x, v)	(*(volatile __typeof__(x) *)&(x) = (v))
+
+#define BITS_PER_LONG	(8 * sizeof(long))
+#define __set_bit(nr, addr)	((addr)[(nr) / BITS_PER_LONG] |= 1UL << ((nr) % BITS_PER_LONG))
+
+#define le16_to_cpu(x)	le16toh(x)
+
+#define get_unaligned(p) ({						\
+	const struct { __typeof__(*(p)) v; } __attribute__((packed)) *__pp =	\
+		(const void *)(p);						\
+	__pp->v;								\
+})
+
+#define module_param(name, type, perm)
+#define MODULE_PARM_DESC(name, desc)
+
+#endif	/* _LUNIX_USPACE_H */